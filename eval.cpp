@@ -7,31 +7,31 @@
 
 // Primitives
 Cell* prim_car(Cell* args) {
-    if (!is_cons(args) || args->pair.cdr != nil) throw std::runtime_error("car expects 1 argument");
-    Cell* c = args->pair.car;
+    if (!is_cons(args) || cdr(args) != nil) throw std::runtime_error("car expects 1 argument");
+    Cell* c = car(args);
     if (!is_cons(c)) throw std::runtime_error("car expects a list");
-    return c->pair.car;
+    return car(c);
 }
 
 Cell* prim_cdr(Cell* args) {
-    if (!is_cons(args) || args->pair.cdr != nil) throw std::runtime_error("cdr expects 1 argument");
-    Cell* c = args->pair.car;
+    if (!is_cons(args) || cdr(args) != nil) throw std::runtime_error("cdr expects 1 argument");
+    Cell* c = car(args);
     if (!is_cons(c)) throw std::runtime_error("cdr expects a list");
-    return c->pair.cdr;
+    return cdr(c);
 }
 
 Cell* prim_cons(Cell* args) {
     // args should be (x y)
-    if (!is_cons(args) || !is_cons(args->pair.cdr) || args->pair.cdr->pair.cdr != nil)
+    if (!is_cons(args) || !is_cons(cdr(args)) || cdr(cdr(args)) != nil)
         throw std::runtime_error("cons expects 2 arguments");
-    Cell* x = args->pair.car;
-    Cell* y = args->pair.cdr->pair.car;
+    Cell* x = car(args);
+    Cell* y = car(cdr(args));
     return cons(x, y);
 }
 
 Cell* prim_atom(Cell* args) {
-    if (!is_cons(args) || args->pair.cdr != nil) throw std::runtime_error("atom expects 1 argument");
-    Cell* c = args->pair.car;
+    if (!is_cons(args) || cdr(args) != nil) throw std::runtime_error("atom expects 1 argument");
+    Cell* c = car(args);
     if (is_symbol(c)) return truth;
     return nil; // In Lisp 1.5, (atom '()) is true because nil is an atom.
     // My implementation: nil is a SYMBOL, so it returns true. Correct.
@@ -39,10 +39,10 @@ Cell* prim_atom(Cell* args) {
 }
 
 Cell* prim_eq(Cell* args) {
-    if (!is_cons(args) || !is_cons(args->pair.cdr) || args->pair.cdr->pair.cdr != nil)
+    if (!is_cons(args) || !is_cons(cdr(args)) || cdr(cdr(args)) != nil)
         throw std::runtime_error("eq expects 2 arguments");
-    Cell* x = args->pair.car;
-    Cell* y = args->pair.cdr->pair.car;
+    Cell* x = car(args);
+    Cell* y = car(cdr(args));
 
     if (is_symbol(x) && is_symbol(y)) {
         return (x == y) ? truth : nil;
@@ -51,8 +51,8 @@ Cell* prim_eq(Cell* args) {
 }
 
 Cell* prim_null(Cell* args) {
-     if (!is_cons(args) || args->pair.cdr != nil) throw std::runtime_error("null expects 1 argument");
-    Cell* c = args->pair.car;
+     if (!is_cons(args) || cdr(args) != nil) throw std::runtime_error("null expects 1 argument");
+    Cell* c = car(args);
     // (null x) is (eq x nil)
     return (c == nil) ? truth : nil;
 }
@@ -65,29 +65,48 @@ Cell* lookup(Cell* atom, Cell* env) {
     // Env is ((k . v) ...)
     Cell* curr = env;
     while (is_cons(curr)) {
-        Cell* pair = curr->pair.car;
+        Cell* pair = car(curr);
         if (is_cons(pair)) {
-            if (pair->pair.car == atom) {
-                return pair->pair.cdr;
+            if (car(pair) == atom) {
+                return cdr(pair);
             }
         }
-        curr = curr->pair.cdr;
+        curr = cdr(curr);
     }
-    throw std::runtime_error("Unbound symbol: " + *atom->symbol_name);
+    throw std::runtime_error("Unbound symbol: " + std::string(symbol_name(atom)));
 }
 
 // Eval List (helper for function application)
-Cell* evlis(Cell* list, Cell* env) {
-    if (list == nil) return nil;
+// Evaluate the rest of an argument list. Each value so far is held in a
+// rooted local further up the recursion, and items[0..n) points at each one,
+// so the whole argument list can be allocated in one piece at the end.
+Cell* evlis_items(Cell* list, Cell* env, Cell*** items, size_t n) {
+    if (list == nil) return make_list(items, n, nil);
     if (!is_cons(list)) throw std::runtime_error("evlis expected list");
 
-    Cell* head = eval(list->pair.car, env);
-    // We need to protect 'head' from GC if eval(rest) triggers it?
-    // But 'head' is a result, so it should be safe if passed as root or stored in stack.
-    // See previous discussion on GC roots. For now we assume safety or leak.
+    // Any evaluation may trigger a collection, so everything we hold across
+    // one is registered as a root.
+    Root r_list(list), r_env(env);
+
+    Cell* head = eval(car(list), env);
+    Root r_head(head);
+    items[n] = &head;
 
-    Cell* tail = evlis(list->pair.cdr, env);
-    return cons(head, tail);
+    return evlis_items(cdr(list), env, items, n + 1);
+}
+
+// Most calls take a few arguments, whose slots fit in a buffer on the stack;
+// only longer argument lists need one from the heap.
+const size_t EVLIS_INLINE_ARGS = 8;
+
+Cell* evlis(Cell* list, Cell* env) {
+    size_t arity = 0;
+    for (Cell* c = list; is_cons(c); c = cdr(c)) ++arity;
+
+    Cell** inline_items[EVLIS_INLINE_ARGS];
+    std::vector<Cell**> heap_items(arity > EVLIS_INLINE_ARGS ? arity : 0);
+    Cell*** items = heap_items.empty() ? inline_items : heap_items.data();
+    return evlis_items(list, env, items, 0);
 }
 
 Cell* eval(Cell* expr, Cell* env) {
@@ -96,28 +115,31 @@ Cell* eval(Cell* expr, Cell* env) {
     }
 
     if (is_cons(expr)) {
-        Cell* fn = expr->pair.car;
-        Cell* args = expr->pair.cdr;
+        Cell* fn = car(expr);
+        Cell* args = cdr(expr);
+        Root r_fn(fn), r_env(env);
 
         // Special forms
         if (is_symbol(fn)) {
-            std::string name = *fn->symbol_name;
+            std::string_view name = symbol_name(fn);
             if (name == "quote") {
-                if (!is_cons(args) || args->pair.cdr != nil) throw std::runtime_error("quote expects 1 argument");
-                return args->pair.car;
+                if (!is_cons(args) || cdr(args) != nil) throw std::runtime_error("quote expects 1 argument");
+                return car(args);
             }
             if (name == "cond") {
                 // (cond (p1 e1) (p2 e2) ...)
                 Cell* curr = args;
+                Root r_curr(curr);
                 while (is_cons(curr)) {
-                    Cell* clause = curr->pair.car;
-                    if (!is_cons(clause) || !is_cons(clause->pair.cdr)) throw std::runtime_error("cond clause invalid");
+                    Cell* clause = car(curr);
+                    Root r_clause(clause);
+                    if (!is_cons(clause) || !is_cons(cdr(clause))) throw std::runtime_error("cond clause invalid");
 
-                    Cell* pred = eval(clause->pair.car, env);
+                    Cell* pred = eval(car(clause), env);
                     if (pred != nil) {
-                        return eval(clause->pair.cdr->pair.car, env);
+                        return eval(car(cdr(clause)), env);
                     }
-                    curr = curr->pair.cdr;
+                    curr = cdr(curr);
                 }
                 return nil; // Undefined? Or nil.
             }
@@ -132,8 +154,12 @@ Cell* eval(Cell* expr, Cell* env) {
 }
 
 Cell* apply(Cell* fn, Cell* args, Cell* env) {
+    Root r_fn(fn), r_args(args), r_env(env);
+
     if (is_symbol(fn)) {
-        std::string name = *fn->symbol_name;
+        // A copy: the call below may collect, and a collection can move the
+        // names of the symbols it keeps.
+        std::string name(symbol_name(fn));
         if (name == "car") return prim_car(args);
         if (name == "cdr") return prim_cdr(args);
         if (name == "cons") return prim_cons(args);
@@ -151,7 +177,7 @@ Cell* apply(Cell* fn, Cell* args, Cell* env) {
         // BUT, if I have `(myfunc arg)`, `myfunc` is a symbol.
         // If `myfunc` is not a primitive, I should probably evaluate `myfunc` first?
         // "If expr is a list: ... Otherwise, it's a function application. Evaluate arguments ... then call apply."
-        // The `fn` passed to `apply` is `expr->pair.car` which is UN-EVALUATED if it is a symbol.
+        // The `fn` passed to `apply` is `car(expr)` which is UN-EVALUATED if it is a symbol.
         // But in Lisp 1.5, the car of the form IS the function.
         // If it is a symbol, it names a function.
         // We check primitives. If not primitive, we should look it up?
@@ -175,26 +201,27 @@ Cell* apply(Cell* fn, Cell* args, Cell* env) {
     }
 
     if (is_cons(fn)) {
-        Cell* tag = fn->pair.car;
+        Cell* tag = car(fn);
         if (is_symbol(tag)) {
-            std::string name = *tag->symbol_name;
+            std::string_view name = symbol_name(tag);
             if (name == "lambda") {
                 // (lambda (params) body)
                 // args are evaluated values.
-                Cell* params = fn->pair.cdr->pair.car;
-                Cell* body = fn->pair.cdr->pair.cdr->pair.car;
+                Cell* params = car(cdr(fn));
+                Cell* body = car(cdr(cdr(fn)));
+                Root r_body(body);
 
                 // Bind args to params
                 Cell* new_env = env; // Extend env
                 // pairlis
                 Cell* p = params;
                 Cell* a = args;
+                Root r_new_env(new_env), r_p(p), r_a(a);
                 while (is_cons(p) && is_cons(a)) {
-                    Cell* var = p->pair.car;
-                    Cell* val = a->pair.car;
-                    new_env = cons(cons(var, val), new_env);
-                    p = p->pair.cdr;
-                    a = a->pair.cdr;
+                    Cell* binding = cons(car(p), car(a));
+                    new_env = cons(binding, new_env);
+                    p = cdr(p);
+                    a = cdr(a);
                 }
                 if (p != nil || a != nil) throw std::runtime_error("Arity mismatch");
 
@@ -202,11 +229,13 @@ Cell* apply(Cell* fn, Cell* args, Cell* env) {
             }
             if (name == "label") {
                 // (label name lambda)
-                Cell* fname = fn->pair.cdr->pair.car;
-                Cell* lambda = fn->pair.cdr->pair.cdr->pair.car;
+                Cell* fname = car(cdr(fn));
+                Cell* lambda = car(cdr(cdr(fn)));
+                Root r_lambda(lambda);
 
                 // Bind name to lambda in env, then apply lambda
-                Cell* new_env = cons(cons(fname, lambda), env);
+                Cell* binding = cons(fname, lambda);
+                Cell* new_env = cons(binding, env);
                 return apply(lambda, args, new_env);
             }
         }
@@ -272,3 +301,31 @@ TEST_CASE("Evaluator: Label/Recursion") {
     Cell* result = eval(expr, env);
     CHECK(print(result) == "(a b c d)");
 }
+
+TEST_CASE("Evaluator: Generational collection during deep recursion") {
+    init_memory();
+    set_gc_mode(GC_GENERATIONAL);
+
+    // Reversing a long list allocates several nursery's worth of
+    // environments and argument lists, all while deep inside eval.
+    std::string items;
+    std::string reversed;
+    for (int i = 0; i < 500; ++i) {
+        std::string atom = "a" + std::to_string(i);
+        items += " " + atom;
+        reversed = atom + (reversed.empty() ? "" : " ") + reversed;
+    }
+    std::string code =
+        "((label rev (lambda (x acc) "
+        "   (cond ((null x) acc) "
+        "         (t (rev (cdr x) (cons (car x) acc)))))) "
+        " (quote (" + items + ")) nil)";
+
+    Cell* expr = read(code);
+    Root r_expr(expr);
+    for (int i = 0; i < 20; ++i) {
+        CHECK(print(eval(expr, nil)) == "(" + reversed + ")");
+    }
+
+    set_gc_mode(GC_MARK_SWEEP);
+}
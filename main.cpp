@@ -2,6 +2,8 @@
 #include <vector>
 #include <string>
 #include <fstream>
+#include <cstdlib>
+#include <stdexcept>
 
 #define DOCTEST_CONFIG_IMPLEMENT
 #include "doctest.h"
@@ -52,7 +54,23 @@ void repl() {
     }
 }
 
-void run_file(const std::string& filename) {
+// With --arena, the cells each top-level form allocates are released as
+// soon as its result is printed, instead of being left for the collector.
+bool arena_forms = false;
+
+// Evaluate a top-level form and print its result.
+void run_form(Cell* expr) {
+    if (arena_forms) arena_begin();
+    Cell* result = eval(expr, nil);
+    std::cout << print(result) << "\n";
+    if (arena_forms) arena_end();
+}
+
+// Run each form in a file. Each form is read into the immortal region, so
+// collections while it runs need not trace it, and released once it has run.
+// If 'forms' is given, the forms are kept and collected there instead; they
+// must all fit in the immortal region, which keeps them alive without roots.
+void run_file(const std::string& filename, std::vector<Cell*>* forms = nullptr) {
     std::ifstream file(filename);
     if (!file) {
         std::cerr << "Could not open file: " << filename << "\n";
@@ -62,13 +80,18 @@ void run_file(const std::string& filename) {
     std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
     auto tokens = tokenize(content);
 
-    Cell* global_env = nil;
-
     while (!tokens.empty()) {
         try {
-            Cell* expr = read_from_tokens(tokens);
-            Cell* result = eval(expr, global_env);
-            std::cout << print(result) << "\n";
+            size_t mark = immortal_mark();
+            Cell* expr = read_from_tokens(tokens, true);
+            if (forms) {
+                if (!is_immortal(expr)) {
+                    throw std::runtime_error("Prelude does not fit in the immortal region");
+                }
+                forms->push_back(expr);
+            }
+            run_form(expr);
+            if (!forms) release_immortal(mark);
         } catch (const std::exception& e) {
             std::cerr << "Error: " << e.what() << "\n";
             exit(1);
@@ -76,11 +99,41 @@ void run_file(const std::string& filename) {
     }
 }
 
-int main(int argc, char** argv) {
-    init_memory();
+// Run a prelude file and save its forms, and the symbols they use, as an image.
+void save_prelude(const std::string& filename, const std::string& image) {
+    std::vector<Cell*> forms;
+    run_file(filename, &forms);
+
+    std::vector<Cell**> items;
+    for (Cell*& form : forms) {
+        items.push_back(&form);
+    }
+    try {
+        save_image(image, make_immortal_list(items.data(), items.size(), nil));
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        exit(1);
+    }
+}
+
+// Load an image saved by save_prelude() and run its forms, without reading
+// them again.
+void run_image(const std::string& image) {
+    try {
+        for (Cell* forms = load_image(image); is_cons(forms); forms = cdr(forms)) {
+            run_form(car(forms));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        exit(1);
+    }
+}
 
+int main(int argc, char** argv) {
     bool test_mode = false;
     std::string filename;
+    std::string image;
+    std::string save_image_file;
 
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
@@ -88,6 +141,52 @@ int main(int argc, char** argv) {
             test_mode = true;
         } else if (arg == "--trace") {
             gc_trace = true;
+        } else if (arg == "--arena") {
+            arena_forms = true;
+        } else if (arg == "--hash-cons") {
+            hash_cons = true;
+        } else if (arg == "--gc-dedup") {
+            gc_dedup = true;
+        } else if (arg.rfind("--gc-stats=", 0) == 0) {
+            gc_stats_file = arg.substr(11);
+        } else if (arg.rfind("--image=", 0) == 0) {
+            image = arg.substr(8);
+        } else if (arg.rfind("--save-image=", 0) == 0) {
+            save_image_file = arg.substr(13);
+        } else if (arg.rfind("--gc-threads=", 0) == 0) {
+            gc_threads = std::atoi(arg.c_str() + 13);
+            if (gc_threads < 1) {
+                std::cerr << "Invalid GC thread count: " << arg.substr(13) << "\n";
+                return 1;
+            }
+        } else if (arg.rfind("--heap-initial=", 0) == 0) {
+            heap_initial = std::strtoul(arg.c_str() + 15, nullptr, 10);
+            if (heap_initial == 0) {
+                std::cerr << "Invalid heap size: " << arg.substr(15) << "\n";
+                return 1;
+            }
+        } else if (arg.rfind("--heap-max=", 0) == 0) {
+            heap_max = std::strtoul(arg.c_str() + 11, nullptr, 10);
+            if (heap_max == 0) {
+                std::cerr << "Invalid heap size: " << arg.substr(11) << "\n";
+                return 1;
+            }
+        } else if (arg.rfind("--gc=", 0) == 0) {
+            std::string mode = arg.substr(5);
+            if (mode == "mark-sweep") {
+                gc_mode = GC_MARK_SWEEP;
+            } else if (mode == "generational") {
+                gc_mode = GC_GENERATIONAL;
+            } else if (mode == "copying") {
+                gc_mode = GC_COPYING;
+            } else if (mode == "compact") {
+                gc_mode = GC_COMPACT;
+            } else if (mode == "concurrent") {
+                gc_mode = GC_CONCURRENT;
+            } else {
+                std::cerr << "Unknown GC mode: " << mode << "\n";
+                return 1;
+            }
         } else {
             if (arg[0] != '-') {
                 filename = arg;
@@ -95,12 +194,34 @@ int main(int argc, char** argv) {
         }
     }
 
+    init_memory();
+    if (!gc_stats_file.empty()) {
+        std::atexit(write_gc_stats);
+    }
+
     if (test_mode) {
         doctest::Context context;
         context.applyCommandLine(argc, argv);
         return context.run();
     }
 
+    if (!save_image_file.empty()) {
+        if (filename.empty()) {
+            std::cerr << "--save-image needs a prelude file\n";
+            return 1;
+        }
+        if (!image.empty()) {
+            std::cerr << "--save-image cannot be combined with --image\n";
+            return 1;
+        }
+        save_prelude(filename, save_image_file);
+        return 0;
+    }
+
+    if (!image.empty()) {
+        run_image(image);
+    }
+
     if (!filename.empty()) {
         run_file(filename);
     } else {
@@ -1,257 +1,3390 @@
 #include "memory.h"
 #include <iostream>
 #include <vector>
-#include <unordered_map>
+#include <algorithm>
 #include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <fstream>
+#include <cstdio>
+#include <chrono>
+#include <cmath>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "doctest.h"
 
-// Constants
-const size_t HEAP_SIZE = 1000000;
-Cell heap[HEAP_SIZE];
-Cell* free_list = nullptr;
+// The main heap is sized at runtime. Address space for heap_max cells is
+// reserved when memory is initialized, but only the first heap_size cells are
+// in use, and the heap grows a chunk at a time. Refs stay plain indices into
+// one array, which separately allocated chunks would not allow without a
+// table lookup on every car and cdr.
+const size_t HEAP_CHUNK = 65536;
+size_t heap_initial = 4 * HEAP_CHUNK;
+size_t heap_max = 256 * HEAP_CHUNK;
+size_t heap_size = 0;
+
+// A collection that leaves more than this fraction of the heap live grows it
+// until the live cells fill no more than that fraction. One that leaves less
+// than an eighth of it live shrinks the heap, down to no less than
+// heap_initial, and returns the pages above it to the OS.
+const double HEAP_TARGET_LIVE = 0.5;
+
+// The heap is mapped for transparent huge pages, and pages are only returned
+// in whole huge pages so that none is split.
+const size_t HUGE_PAGE = size_t(2) << 20;
+
+// In generational mode, cons() bump-allocates from a nursery placed directly
+// above the largest the main heap can grow to, at [heap_max, heap_max +
+// NURSERY_SIZE). The nursery is only ever emptied by a minor collection,
+// which promotes its survivors onto the main heap's free list.
+const size_t NURSERY_SIZE = 65536;
+
+// Program text lives in an immortal region directly above the nursery, at
+// [immortal_base, immortal_base + IMMORTAL_SIZE). Collections count every
+// cell there as live and never mark, sweep or move it. An immortal cell only
+// ever points at other immortal cells, so nothing else is kept alive through
+// the region and no collection needs to look inside it.
+const size_t IMMORTAL_SIZE = size_t(1) << 20;
+size_t immortal_base = 0;
+size_t immortal_top = 0;
+
+inline bool is_immortal_ref(Ref r) {
+    return r >= immortal_base;
+}
+
+// In copying mode, the main heap is split into two semispaces of heap_size / 2
+// cells. cons() bump-allocates from the current one, and a collection copies
+// the live cells into the other.
+
+Cell* heap = nullptr;
+size_t free_count = 0;
+size_t nursery_top = 0;
+size_t space_lo = 0;
 bool heap_initialized = false;
 
-// Atom Table: Maps string name to the unique Symbol Cell
-std::unordered_map<std::string, Cell*> atom_table;
+// Allocation bumps through [alloc_top, alloc_end): the current semispace, the
+// free space above compacted data, or, in the free-list modes, the current
+// run of free cells.
+size_t alloc_top = 0;
+size_t alloc_end = 0;
+
+// In the free-list modes, sweeping records each stretch of consecutive dead
+// cells as a FreeRun. Allocation works through them in address order,
+// starting at next_run, so consecutive conses land next to each other.
+struct FreeRun {
+    Ref begin;
+    Ref end;
+};
+
+std::vector<FreeRun> free_runs;
+size_t next_run = 0;
+
+// Cells at or above the frontier have never been handed out. Once the free
+// runs are used up, allocation takes fresh cells from the frontier a step at
+// a time, and sweeping never looks past it, so neither startup nor a
+// collection touches heap pages the program has not used yet.
+const size_t FRONTIER_STEP = 4096;
+size_t frontier = 0;
+
+// Bumped by every collection, and whenever the heap is laid out again or
+// grows, so an arena mark can tell whether allocation has only moved forward
+// since it was taken.
+size_t alloc_epoch = 0;
+
+// A promoted or copied cell has FORWARD_TAG in its car and its new Ref in its cdr.
+const Ref FORWARD_TAG = Ref(1) << 30;
+
+// Every Ref must stay below FORWARD_TAG, or a car holding it would look forwarded.
+const size_t MAX_HEAP_CELLS = FORWARD_TAG - NURSERY_SIZE - IMMORTAL_SIZE;
+
+// Mark bits live in a side bitmap, one bit per heap slot, rather than in the Cells.
+// Sweep can then test 64 cells per word, and clearing all marks is a memset.
+// The bitmap also covers the nursery, which is marked through but never swept.
+// It does not cover the immortal region, whose cells all count as marked.
+uint64_t* mark_bits = nullptr;
+
+// Bitmap words covering the part of the main heap in use.
+inline size_t heap_words() {
+    return (heap_size + 63) / 64;
+}
+
+void clear_nursery_marks() {
+    std::memset(&mark_bits[heap_max / 64], 0, NURSERY_SIZE / 64 * sizeof(uint64_t));
+}
+
+void clear_marks() {
+    std::memset(mark_bits, 0, heap_words() * sizeof(uint64_t));
+    clear_nursery_marks();
+}
+
+// Symbols, indexed by the low bits of a symbol cell's car. Each keeps its
+// name, the hash of the name, and its cell. The table is weak: only pinned
+// symbols are roots, and any other symbol that a collection finds unreachable
+// is dropped, its cell reclaimed and the rest renumbered. So is a duplicate,
+// which lost a race to intern the same name and is not in the atom table.
+struct Symbol {
+    std::string_view name;
+    size_t hash;
+    Cell* cell;
+    bool pinned;
+    bool duplicate;
+};
+
+// The records live in chunks that never move, so one thread can read a
+// record while another adds one. Records are added under intern_lock and
+// removed only by collections.
+const size_t SYMBOL_CHUNK_BITS = 12;
+const size_t SYMBOL_CHUNK = size_t(1) << SYMBOL_CHUNK_BITS;
+const size_t SYMBOL_CHUNKS = size_t(1) << 16;
+
+class SymbolStore {
+public:
+    Symbol& operator[](size_t i) {
+        return chunks_[i >> SYMBOL_CHUNK_BITS][i & (SYMBOL_CHUNK - 1)];
+    }
+
+    size_t size() const { return count_.load(std::memory_order_acquire); }
+
+    uint32_t push_back(const Symbol& sym) {
+        size_t i = count_.load(std::memory_order_relaxed);
+        if (i == SYMBOL_CHUNK * SYMBOL_CHUNKS) {
+            std::cerr << "Fatal Error: Too many symbols.\n";
+            exit(1);
+        }
+        std::unique_ptr<Symbol[]>& chunk = chunks_[i >> SYMBOL_CHUNK_BITS];
+        if (!chunk) chunk.reset(new Symbol[SYMBOL_CHUNK]);
+        chunk[i & (SYMBOL_CHUNK - 1)] = sym;
+        count_.store(i + 1, std::memory_order_release);
+        return uint32_t(i);
+    }
+
+    // Only ever shrinks; collections use it to drop renumbered records.
+    void resize(size_t n) { count_.store(n, std::memory_order_release); }
+
+private:
+    std::unique_ptr<Symbol[]> chunks_[SYMBOL_CHUNKS];
+    std::atomic<size_t> count_{0};
+};
+
+SymbolStore symbols;
+
+// Serializes making new symbols: the heap and the name arena are not
+// thread-safe. Lookups never take it.
+std::mutex intern_lock;
+
+// Symbol names are packed into an arena of fixed-size blocks, so the
+// characters of a name stay put once stored. A name too long for a block
+// gets a block of its own.
+const size_t NAME_BLOCK_SIZE = 65536;
+std::vector<std::unique_ptr<char[]>> name_blocks;
+size_t name_block_used = NAME_BLOCK_SIZE;
+size_t name_arena_size = 0;
+
+std::string_view store_name(std::string_view name) {
+    if (name.size() > NAME_BLOCK_SIZE - name_block_used) {
+        size_t size = std::max(name.size(), NAME_BLOCK_SIZE);
+        name_blocks.emplace_back(new char[size]);
+        name_block_used = 0;
+        name_arena_size += size;
+    }
+    char* p = name_blocks.back().get() + name_block_used;
+    std::memcpy(p, name.data(), name.size());
+    name_block_used += name.size();
+    return std::string_view(p, name.size());
+}
+
+// Give back the space of a name, which must be the last one stored and still
+// in the arena. Names stored elsewhere, as by load_image(), are left alone.
+void unstore_name(std::string_view name) {
+    if (name_blocks.empty()) return;
+    char* block = name_blocks.back().get();
+    size_t offset = reinterpret_cast<uintptr_t>(name.data()) - reinterpret_cast<uintptr_t>(block);
+    if (offset == 0 && !name.empty()) {
+        // The block was made for this name.
+        name_arena_size -= std::max(name.size(), NAME_BLOCK_SIZE);
+        name_blocks.pop_back();
+        name_block_used = NAME_BLOCK_SIZE;
+    } else if (offset + name.size() <= name_block_used) {
+        name_block_used = offset;
+    }
+}
+
+// Atom table: an open-addressing hash table in the style of a Swiss table,
+// which several threads can intern into at once. Slots come in groups of 8,
+// whose control bytes share one 64-bit word. A control byte is 0 for an
+// empty slot, 1 for a deleted one and otherwise 0x80 plus 7 bits of the hash
+// of the symbol in it.
+// A lookup compares a whole group of control bytes at once and only checks
+// the names of the symbols whose bits match. It can be probed with any
+// string_view, so looking up a token allocates nothing.
+//
+// Lookups take no lock. A new symbol is published by a CAS on an empty slot,
+// so two threads interning the same name both end up with the one symbol
+// whose CAS won. The control byte is set after the slot, which makes it a
+// hint: a lookup that misses because of it falls through to the insert,
+// which reads the slots themselves and finds the symbol there.
+//
+// A full table is replaced by a bigger one. The old table's empty slots are
+// frozen first, so an insert either lands before its slot is copied or sees
+// ATOM_FROZEN and retries in the new table. Replaced tables stay readable
+// until the next collection, which, like cons(), must not run while other
+// threads intern.
+//
+// Released program text takes its symbols out of the table. A slot in a
+// group that still has an empty one is simply emptied, since no probe goes
+// past that group. Otherwise it is left deleted, which probes pass over, and
+// stays taken until the next rebuild of the table.
+const size_t ATOM_GROUP = 8;
+const uint32_t ATOM_FROZEN = ~uint32_t(0);
+const uint32_t ATOM_DELETED = ~uint32_t(0) - 1;
+const uint8_t ATOM_DELETED_CTRL = 1;
+
+struct AtomTable {
+    explicit AtomTable(size_t size)
+        : size(size),
+          ctrl(new std::atomic<uint64_t>[size / ATOM_GROUP]()),
+          slots(new std::atomic<uint32_t>[size]()) {}
+
+    size_t size;
+    std::unique_ptr<std::atomic<uint64_t>[]> ctrl;
+    std::unique_ptr<std::atomic<uint32_t>[]> slots;  // Symbol index + 1, or 0
+    std::atomic<size_t> count{0};
+};
+
+std::atomic<AtomTable*> atom_table{nullptr};
+std::vector<std::unique_ptr<AtomTable>> atom_tables;  // Current one last
+
+// The high bit is set in each byte of 'word' that equals 'byte'.
+inline uint64_t match_group(uint64_t word, uint8_t byte) {
+    const uint64_t low7 = 0x7F7F7F7F7F7F7F7Full;
+    uint64_t x = word ^ (0x0101010101010101ull * byte);
+    return ~(((x & low7) + low7) | x) & ~low7;
+}
+
+inline uint8_t atom_tag(size_t hash) {
+    return uint8_t(0x80 | (hash & 0x7F));
+}
+
+// Find the symbol with this name and hash in t, or return -1.
+long find_atom(AtomTable* t, std::string_view name, size_t hash) {
+    size_t groups = t->size / ATOM_GROUP;
+    size_t g = (hash >> 7) & (groups - 1);
+    for (size_t probe = 1; probe <= groups; ++probe) {
+        uint64_t ctrl = t->ctrl[g].load(std::memory_order_acquire);
+        for (uint64_t m = match_group(ctrl, atom_tag(hash)); m; m &= m - 1) {
+            size_t i = g * ATOM_GROUP + __builtin_ctzll(m) / 8;
+            uint32_t v = t->slots[i].load(std::memory_order_acquire);
+            const Symbol& sym = symbols[v - 1];
+            if (sym.hash == hash && sym.name == name) return long(v - 1);
+        }
+        if (match_group(ctrl, 0)) return -1;
+        g = (g + probe) & (groups - 1);
+    }
+    return -1;
+}
+
+// Put symbol 'index' in t, unless a symbol with the same name is there or
+// gets there first. Returns the index of the symbol that ends up in the
+// table, or -1 if t is being replaced.
+long insert_atom(AtomTable* t, uint32_t index) {
+    const Symbol& sym = symbols[index];
+    size_t groups = t->size / ATOM_GROUP;
+    size_t g = (sym.hash >> 7) & (groups - 1);
+    for (size_t probe = 1; probe <= groups; ++probe) {
+        for (size_t k = 0; k < ATOM_GROUP; ++k) {
+            std::atomic<uint32_t>& slot = t->slots[g * ATOM_GROUP + k];
+            uint32_t v = slot.load(std::memory_order_acquire);
+            if (v == 0 && slot.compare_exchange_strong(v, index + 1,
+                                                       std::memory_order_acq_rel)) {
+                t->ctrl[g].fetch_or(uint64_t(atom_tag(sym.hash)) << (8 * k),
+                                    std::memory_order_release);
+                t->count.fetch_add(1, std::memory_order_relaxed);
+                return long(index);
+            }
+            if (v == ATOM_FROZEN) return -1;
+            if (v == ATOM_DELETED) continue;
+            const Symbol& other = symbols[v - 1];
+            if (other.hash == sym.hash && other.name == sym.name) return long(v - 1);
+        }
+        g = (g + probe) & (groups - 1);
+    }
+    return -1;  // Unreachable: tables are replaced well before they fill
+}
+
+// Take symbol 'index' out of t, if it is there. Other threads must not be
+// interning.
+void erase_atom(AtomTable* t, uint32_t index) {
+    const Symbol& sym = symbols[index];
+    size_t groups = t->size / ATOM_GROUP;
+    size_t g = (sym.hash >> 7) & (groups - 1);
+    for (size_t probe = 1; probe <= groups; ++probe) {
+        uint64_t ctrl = t->ctrl[g].load(std::memory_order_relaxed);
+        for (size_t k = 0; k < ATOM_GROUP; ++k) {
+            std::atomic<uint32_t>& slot = t->slots[g * ATOM_GROUP + k];
+            if (slot.load(std::memory_order_relaxed) != index + 1) continue;
+            bool group_has_empty = match_group(ctrl, 0);
+            ctrl &= ~(uint64_t(0xFF) << (8 * k));
+            if (group_has_empty) {
+                slot.store(0, std::memory_order_release);
+                t->count.fetch_sub(1, std::memory_order_relaxed);
+            } else {
+                slot.store(ATOM_DELETED, std::memory_order_release);
+                ctrl |= uint64_t(ATOM_DELETED_CTRL) << (8 * k);
+            }
+            t->ctrl[g].store(ctrl, std::memory_order_release);
+            return;
+        }
+        if (match_group(ctrl, 0)) return;
+        g = (g + probe) & (groups - 1);
+    }
+}
+
+// Make a new current table with room for 'count' symbols at most 7/8 full.
+AtomTable* new_atom_table(size_t count) {
+    size_t size = 4 * ATOM_GROUP;
+    while (size * 7 / 8 <= count) size *= 2;
+    atom_tables.emplace_back(new AtomTable(size));
+    return atom_tables.back().get();
+}
+
+// Replace t, if it is still current, by a table with room for half as many
+// symbols again as there are. That is twice the size, unless deleted slots
+// filled t.
+void grow_atoms(AtomTable* t) {
+    std::lock_guard<std::mutex> guard(intern_lock);
+    if (atom_table.load(std::memory_order_acquire) != t) return;
+    AtomTable* bigger = new_atom_table(symbols.size() + symbols.size() / 2);
+    for (size_t i = 0; i < t->size; ++i) {
+        uint32_t v = 0;
+        if (t->slots[i].compare_exchange_strong(v, ATOM_FROZEN,
+                                                std::memory_order_acq_rel)) {
+            continue;
+        }
+        if (v != ATOM_DELETED) insert_atom(bigger, v - 1);
+    }
+    atom_table.store(bigger, std::memory_order_release);
+}
+
+// Rebuild the table from the symbols left by a collection, freeing any
+// replaced tables.
+void rehash_atoms() {
+    atom_tables.clear();
+    AtomTable* t = new_atom_table(symbols.size());
+    for (size_t i = 0; i < symbols.size(); ++i) {
+        insert_atom(t, uint32_t(i));
+    }
+    atom_table.store(t, std::memory_order_release);
+}
 
 // Globals
 Cell* nil = nullptr;
 Cell* truth = nullptr;
+GcMode gc_mode = GC_MARK_SWEEP;
+int gc_threads = 1;
 bool gc_trace = false;
+std::string gc_stats_file;
+Root* root_top = nullptr;
 
-// Internal allocation helper
-Cell* alloc_raw() {
-    if (!free_list) {
-        return nullptr;
+// GC statistics, kept when gc_stats_file is set and written out by
+// write_gc_stats(). Each collection adds a GcRecord. The pause is the time
+// the program was stopped; mark and sweep times also count marking on the
+// background thread and sweeping done lazily from alloc_raw(), which is
+// charged to the collection that left it.
+using Clock = std::chrono::steady_clock;
+
+inline double ms_since(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+struct GcRecord {
+    const char* kind;
+    double pause_ms;
+    double mark_ms;
+    double sweep_ms;
+    size_t reclaimed;
+    size_t live;
+    size_t allocated;  // Cells allocated since the previous collection
+};
+
+std::vector<GcRecord> gc_records;
+size_t cells_allocated = 0;
+size_t total_allocated = 0;
+
+// The record of the collection whose marks the pending lazy sweep is using.
+// Minor collections sweep blocks of it too, while promoting.
+size_t sweep_record = SIZE_MAX;
+Clock::time_point start_time;
+
+inline bool keeping_stats() {
+    return !gc_stats_file.empty();
+}
+
+// Count cells handed out to the program.
+inline void count_allocated(size_t n) {
+    cells_allocated += n;
+}
+
+// Record a collection that found 'live' of the 'used' cells still in use.
+void record_gc(const char* kind, double pause_ms, double mark_ms, double sweep_ms,
+               size_t used, size_t live) {
+    total_allocated += cells_allocated;
+    if (keeping_stats()) {
+        gc_records.push_back({kind, pause_ms, mark_ms, sweep_ms,
+                              used > live ? used - live : 0, live, cells_allocated});
     }
-    Cell* c = free_list;
-    free_list = c->pair.cdr; // Move head to next
+    cells_allocated = 0;
+}
 
-    // Reset cell state
-    c->mark = false;
-    // We don't clear type/data yet
-    return c;
+const char* gc_mode_name(GcMode mode) {
+    switch (mode) {
+    case GC_MARK_SWEEP: return "mark-sweep";
+    case GC_GENERATIONAL: return "generational";
+    case GC_COPYING: return "copying";
+    case GC_COMPACT: return "compact";
+    case GC_CONCURRENT: return "concurrent";
+    }
+    return "unknown";
 }
 
-// Mark function for GC
-void mark(Cell* c) {
-    // If null or already marked, stop.
-    // Note: Symbols are Cells too. If we mark a cons, we recurse.
-    // If we mark a symbol, we just mark it and stop (symbols have no children).
-    if (!c || c->mark) return;
+// Write the total and the 50th, 90th and 99th percentiles and maximum of one
+// field over all collections, as a JSON object.
+template <typename F>
+void write_distribution(std::ostream& out, const char* name, F field) {
+    std::vector<double> values;
+    for (const GcRecord& rec : gc_records) {
+        values.push_back(field(rec));
+    }
+    std::sort(values.begin(), values.end());
+
+    // Nearest-rank percentile.
+    auto percentile = [&](double p) {
+        if (values.empty()) return 0.0;
+        size_t rank = size_t(std::ceil(p * values.size()));
+        return values[std::max<size_t>(rank, 1) - 1];
+    };
+    double total = 0;
+    for (double v : values) total += v;
+
+    out << "  \"" << name << "\": {\"total\": " << total
+        << ", \"p50\": " << percentile(0.5) << ", \"p90\": " << percentile(0.9)
+        << ", \"p99\": " << percentile(0.99) << ", \"max\": " << percentile(1.0) << "},\n";
+}
 
-    c->mark = true;
+void write_gc_stats() {
+    if (!keeping_stats()) return;
+    std::ofstream out(gc_stats_file);
+    if (!out) {
+        std::cerr << "Could not write GC statistics: " << gc_stats_file << "\n";
+        return;
+    }
+
+    double elapsed_ms = ms_since(start_time);
+    size_t allocated = total_allocated + cells_allocated;
+    out << "{\n";
+    out << "  \"gc_mode\": \"" << gc_mode_name(gc_mode) << "\",\n";
+    out << "  \"heap_size\": " << heap_size << ",\n";
+    out << "  \"elapsed_ms\": " << elapsed_ms << ",\n";
+    out << "  \"cells_allocated\": " << allocated << ",\n";
+    out << "  \"cells_per_second\": " << (elapsed_ms > 0 ? allocated / elapsed_ms * 1000 : 0) << ",\n";
+    out << "  \"collections\": " << gc_records.size() << ",\n";
+    write_distribution(out, "pause_ms", [](const GcRecord& r) { return r.pause_ms; });
+    write_distribution(out, "mark_ms", [](const GcRecord& r) { return r.mark_ms; });
+    write_distribution(out, "sweep_ms", [](const GcRecord& r) { return r.sweep_ms; });
+    write_distribution(out, "reclaimed", [](const GcRecord& r) { return double(r.reclaimed); });
+    write_distribution(out, "live", [](const GcRecord& r) { return double(r.live); });
+    write_distribution(out, "allocated", [](const GcRecord& r) { return double(r.allocated); });
 
-    if (c->type == Cell::CONS) {
-        mark(c->pair.car);
-        mark(c->pair.cdr);
+    out << "  \"records\": [";
+    for (size_t i = 0; i < gc_records.size(); ++i) {
+        const GcRecord& r = gc_records[i];
+        out << (i ? ",\n" : "\n") << "    {\"kind\": \"" << r.kind << "\", \"pause_ms\": " << r.pause_ms
+            << ", \"mark_ms\": " << r.mark_ms << ", \"sweep_ms\": " << r.sweep_ms
+            << ", \"reclaimed\": " << r.reclaimed << ", \"live\": " << r.live
+            << ", \"allocated\": " << r.allocated << "}";
     }
+    out << (gc_records.empty() ? "]\n" : "\n  ]\n") << "}\n";
 }
 
-// Sweep function
-void sweep() {
-    size_t reclaimed = 0;
-    size_t in_use = 0;
+// In concurrent mode, marking runs on a background thread while eval keeps
+// allocating. A cycle starts when the free cells drop below a quarter of the
+// heap, and the cons() after it finishes sweeps with its marks.
+inline bool concurrent_start_due() {
+    return free_count < heap_size / 4;
+}
+
+struct BackgroundMarker {
+    std::thread thread;
+    std::atomic<bool> done{false};
+    bool active = false;
+    double mark_ms = 0;  // Time the thread spent marking
 
-    // Rebuild free list from scratch?
-    // Or traverse and prepend freed cells to free_list?
-    // Traversing the whole heap is standard.
+    ~BackgroundMarker() {
+        if (thread.joinable()) thread.join();
+    }
+};
+
+BackgroundMarker background;
 
-    // It's easier to rebuild the free list if we want to keep it simple,
-    // but usually we just add dead cells to the existing free list.
-    // Actually, since we sweep the WHOLE heap, we can just rebuild the free list
-    // completely to ensure it's clean and maybe localized.
-    // Let's reset free_list and rebuild it.
+// Lazy sweeping. A collection only marks; alloc_raw() then sweeps the heap
+// one block at a time, whenever the free runs are used up. sweep_cursor is
+// the first bitmap word not yet swept, and sweep_end the word at which the
+// frontier stood when the collection ended.
+const size_t SWEEP_BLOCK_WORDS = 64;
+size_t sweep_cursor = 0;
+size_t sweep_end = 0;
 
-    free_list = nullptr;
+bool sweep_next_block();
 
-    // Iterate from end to beginning to maintain some order, or beginning to end.
-    for (size_t i = 0; i < HEAP_SIZE; ++i) {
-        if (heap[i].mark) {
-            heap[i].mark = false; // Reset for next time
-            in_use++;
+// Make sure [alloc_top, alloc_end) holds at least one free cell. When the
+// current run is used up, move on to the next one, sweeping another block if
+// there is none, and after the last one advance the frontier. Returns false
+// if the heap is full.
+bool next_free_run() {
+    while (alloc_top == alloc_end) {
+        if (next_run < free_runs.size()) {
+            alloc_top = free_runs[next_run].begin;
+            alloc_end = free_runs[next_run].end;
+            next_run++;
+        } else if (sweep_next_block()) {
+            continue;
+        } else if (frontier < heap_size) {
+            alloc_top = frontier;
+            alloc_end = frontier = std::min(frontier + FRONTIER_STEP, heap_size);
         } else {
-            // It's garbage. Add to free list.
-            // We treat the 'cdr' as the next pointer for the free list.
-            // Note: We are corrupting the 'cdr' of the cell, but it's garbage so it's fine.
-            heap[i].type = Cell::CONS; // Ensure we can interpret it as cons for free list? Not strictly needed if we just use pointer arithmetic or union, but good for safety.
-            heap[i].pair.cdr = free_list;
-            free_list = &heap[i];
-            reclaimed++;
+            return false;
         }
     }
+    return true;
+}
 
-    if (gc_trace) {
-        std::cout << "[GC] Reclaimed: " << reclaimed << ", In use: " << in_use << "\n";
+// Cells allocated while a background mark runs are live by definition,
+// so they are born marked.
+void mark_allocated(Ref r, size_t n) {
+    if (!background.active) return;
+    for (Ref i = r; i < r + n; ++i) {
+        __atomic_fetch_or(&mark_bits[i / 64], uint64_t(1) << (i % 64), __ATOMIC_RELAXED);
     }
 }
 
-// Garbage Collection Entry Point
-void gc(std::vector<Cell*> roots) {
-    // Mark roots
-    for (Cell* r : roots) {
-        mark(r);
+// Internal allocation helper: bump through the current free run.
+Cell* alloc_raw() {
+    if (!next_free_run()) return nullptr;
+    Ref r = Ref(alloc_top++);
+    free_count--;
+    mark_allocated(r, 1);
+
+    // We don't clear type/data yet
+    return cell_at(r);
+}
+
+// Internal allocation helper: bump the current semispace
+Cell* alloc_bump() {
+    if (alloc_top == alloc_end) {
+        return nullptr;
     }
+    return &heap[alloc_top++];
+}
+
+// Copying and mark-compact modes allocate by bumping a pointer; the others
+// use the free list.
+bool bump_allocating() {
+    return gc_mode == GC_COPYING || gc_mode == GC_COMPACT;
+}
+
+// Thread-local allocation buffers. cons() takes cells from a buffer private
+// to its thread, [top, end), and refills it a batch at a time from the shared
+// allocator under heap_lock, so threads consing at once only contend once per
+// batch. A buffer filled before the last collection, relayout or growth of
+// the heap is stale, since its cells may since have been swept into free
+// runs or reused, and is dropped; its unused cells are found again by the
+// next sweep. Collections still need every other thread to be stopped, and
+// hash-consing and concurrent mode are not thread-safe at all.
+const size_t TLAB_CELLS = 256;
 
-    // Mark global constants
-    mark(nil);
-    mark(truth);
+struct Tlab {
+    size_t top = 0;
+    size_t end = 0;
+    size_t epoch = ~size_t(0);
+};
 
-    // Mark all interned symbols?
-    // If we want symbols to persist forever (as per fixed atom space implication),
-    // we must mark them.
-    for (auto& kv : atom_table) {
-        mark(kv.second);
+thread_local Tlab tlab;
+std::mutex heap_lock;
+
+// Take up to 'want' consecutive cells, starting at 'first', from wherever
+// cons() allocates in the current mode. Returns how many were taken. The
+// caller holds heap_lock.
+size_t take_batch(size_t want, Ref& first) {
+    size_t n;
+    if (bump_allocating()) {
+        n = std::min(want, alloc_end - alloc_top);
+        first = Ref(alloc_top);
+        alloc_top += n;
+    } else if (gc_mode == GC_GENERATIONAL) {
+        n = std::min(want, heap_max + NURSERY_SIZE - nursery_top);
+        first = Ref(nursery_top);
+        nursery_top += n;
+    } else {
+        if (!next_free_run()) return 0;
+        n = std::min(want, alloc_end - alloc_top);
+        first = Ref(alloc_top);
+        alloc_top += n;
+        free_count -= n;
+        mark_allocated(first, n);
     }
+    count_allocated(n);
+    return n;
+}
 
-    sweep();
+inline bool tlab_current() {
+    return tlab.epoch == alloc_epoch;
 }
 
-Cell* cons(Cell* car, Cell* cdr) {
-    if (!heap_initialized) init_memory();
+// Take a cell from this thread's buffer, refilling it if it is empty or
+// stale. Returns nullptr if the shared allocator has no cells left.
+Cell* alloc_local() {
+    if (!tlab_current() || tlab.top == tlab.end) {
+        std::lock_guard<std::mutex> guard(heap_lock);
+        Ref first;
+        size_t n = take_batch(TLAB_CELLS, first);
+        if (n == 0) return nullptr;
+        tlab = {first, first + n, alloc_epoch};
+    }
+    return &heap[tlab.top++];
+}
 
-    Cell* c = alloc_raw();
-    if (!c) {
-        // Attempt GC.
-        // We protect car and cdr.
-        gc({car, cdr});
-        c = alloc_raw();
-        if (!c) {
-            std::cerr << "Fatal Error: Heap exhausted (cons).\n";
-            exit(1);
+// Take a cell from the main heap, whichever way the current mode manages it.
+Cell* alloc_main() {
+    return bump_allocating() ? alloc_bump() : alloc_raw();
+}
+
+// Pending cars for mark(). Kept between collections so it only grows once.
+std::vector<Ref> mark_stack;
+
+inline bool is_marked(Ref r) {
+    if (is_immortal_ref(r)) return true;
+    return mark_bits[r / 64] & (uint64_t(1) << (r % 64));
+}
+
+// Set the mark bit for r. Returns false if it was already set.
+inline bool try_mark(Ref r) {
+    if (is_immortal_ref(r)) return false;
+    uint64_t bit = uint64_t(1) << (r % 64);
+    if (mark_bits[r / 64] & bit) return false;
+    mark_bits[r / 64] |= bit;
+    return true;
+}
+
+// Mark function for GC
+void mark(Cell* c) {
+    // Symbols are Cells too. If we mark a symbol, we just mark it and stop
+    // (symbols have no children).
+    // Marking does not recurse: it loops along each cdr chain and defers the
+    // cars to an explicit stack, so a long list cannot overflow the C stack.
+    if (!c) return;
+
+    mark_stack.push_back(ref_of(c));
+    while (!mark_stack.empty()) {
+        Ref r = mark_stack.back();
+        mark_stack.pop_back();
+
+        while (try_mark(r)) {
+            Cell* cell = cell_at(r);
+            if (cell->car & SYMBOL_TAG) break;
+
+            // Start fetching both children before we get to them.
+            __builtin_prefetch(cell_at(cell->car));
+            __builtin_prefetch(cell_at(cell->cdr));
+
+            if (!is_marked(cell->car)) {
+                mark_stack.push_back(cell->car);
+            }
+            r = cell->cdr;
         }
     }
+}
 
-    c->type = Cell::CONS;
-    c->pair.car = car;
-    c->pair.cdr = cdr;
-    return c;
+// Run work(i) for each i in [0, n): n - 1 on new threads and one on this one.
+template <typename F>
+void run_parallel(size_t n, F work) {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < n; ++i) {
+        threads.emplace_back(work, i);
+    }
+    work(0);
+    for (std::thread& t : threads) {
+        t.join();
+    }
 }
 
-Cell* make_symbol(const std::string& name) {
-    if (!heap_initialized) init_memory();
+// Parallel marking. Each worker traces from a private stack and, when that
+// stack is deep and its shared stack is empty, publishes the older half of
+// its work there. Workers that run dry take work from their own shared stack
+// first and then steal half of another worker's.
+struct MarkWorker {
+    std::mutex lock;
+    std::vector<Ref> shared;
+    std::atomic<size_t> shared_size{0};
+};
 
-    // Check if already exists
-    auto it = atom_table.find(name);
-    if (it != atom_table.end()) {
-        return it->second;
-    }
+const size_t PUBLISH_THRESHOLD = 64;
 
-    // Allocate new cell for symbol
-    Cell* c = alloc_raw();
-    if (!c) {
-        gc({});
-        c = alloc_raw();
-        if (!c) {
-             std::cerr << "Fatal Error: Heap exhausted (symbol).\n";
-             exit(1);
+inline bool is_marked_atomic(Ref r) {
+    if (is_immortal_ref(r)) return true;
+    return __atomic_load_n(&mark_bits[r / 64], __ATOMIC_RELAXED) & (uint64_t(1) << (r % 64));
+}
+
+// Atomically set the mark bit for r. Returns false if it was already set.
+inline bool try_mark_atomic(Ref r) {
+    if (is_immortal_ref(r)) return false;
+    uint64_t bit = uint64_t(1) << (r % 64);
+    if (__atomic_load_n(&mark_bits[r / 64], __ATOMIC_RELAXED) & bit) return false;
+    return !(__atomic_fetch_or(&mark_bits[r / 64], bit, __ATOMIC_RELAXED) & bit);
+}
+
+// Mark r and the rest of its cdr chain, pushing unmarked cars onto 'stack'.
+// Safe to run on several threads at once.
+inline void mark_chain_atomic(Ref r, std::vector<Ref>& stack) {
+    while (try_mark_atomic(r)) {
+        Cell* cell = cell_at(r);
+        if (cell->car & SYMBOL_TAG) break;
+
+        __builtin_prefetch(cell_at(cell->car));
+        __builtin_prefetch(cell_at(cell->cdr));
+
+        if (!is_marked_atomic(cell->car)) {
+            stack.push_back(cell->car);
         }
+        r = cell->cdr;
     }
+}
 
-    // We need to store the string name persistently.
-    // The map key stores a copy of the string.
-    // We can point to the key string in the map.
-    // Insertion into unordered_map does not invalidate pointers to elements (C++17 standard for node-based maps, but check?)
-    // std::unordered_map reference stability: "References and pointers to either key or data are invalidated only when the corresponding element is deleted."
-    // Since we never delete symbols, this is safe.
+bool take_mark_work(std::vector<MarkWorker>& workers, size_t self, std::vector<Ref>& stack) {
+    for (size_t k = 0; k < workers.size(); ++k) {
+        MarkWorker& w = workers[(self + k) % workers.size()];
+        if (w.shared_size == 0) continue;
 
-    auto result = atom_table.emplace(name, c);
-    const std::string* stored_name = &result.first->first;
+        std::lock_guard<std::mutex> guard(w.lock);
+        if (w.shared.empty()) continue;
+        size_t take = (k == 0) ? w.shared.size() : (w.shared.size() + 1) / 2;
+        stack.insert(stack.end(), w.shared.end() - take, w.shared.end());
+        w.shared.resize(w.shared.size() - take);
+        w.shared_size = w.shared.size();
+        return true;
+    }
+    return false;
+}
 
-    c->type = Cell::SYMBOL;
-    c->symbol_name = stored_name;
+void parallel_mark(const std::vector<Ref>& roots) {
+    size_t n = gc_threads;
+    std::vector<MarkWorker> workers(n);
 
-    return c;
+    // Deal the roots out round-robin.
+    for (size_t i = 0; i < roots.size(); ++i) {
+        workers[i % n].shared.push_back(roots[i]);
+    }
+    for (MarkWorker& w : workers) {
+        w.shared_size = w.shared.size();
+    }
+
+    std::atomic<size_t> idle{0};
+
+    run_parallel(n, [&](size_t self) {
+        std::vector<Ref> stack;
+        for (;;) {
+            while (!stack.empty()) {
+                Ref r = stack.back();
+                stack.pop_back();
+                mark_chain_atomic(r, stack);
+
+                MarkWorker& me = workers[self];
+                if (stack.size() > PUBLISH_THRESHOLD && me.shared_size == 0) {
+                    std::lock_guard<std::mutex> guard(me.lock);
+                    size_t half = stack.size() / 2;
+                    me.shared.insert(me.shared.end(), stack.begin(), stack.begin() + half);
+                    stack.erase(stack.begin(), stack.begin() + half);
+                    me.shared_size = me.shared.size();
+                }
+            }
+
+            if (take_mark_work(workers, self, stack)) continue;
+
+            // Nothing to take. Wait until some other worker publishes work,
+            // or until every worker is idle, which means marking is done.
+            // Only a busy worker publishes, and never while its own shared
+            // stack is non-empty, so once all are idle no work remains.
+            idle++;
+            for (;;) {
+                if (idle == n) return;
+                bool found = false;
+                for (MarkWorker& w : workers) {
+                    if (w.shared_size > 0) found = true;
+                }
+                if (found) {
+                    idle--;
+                    break;
+                }
+                std::this_thread::yield();
+            }
+        }
+    });
 }
 
-void init_memory() {
-    if (heap_initialized) return;
+// Hash-consing. With hash_cons set, cons() first looks for an existing cell
+// with the same car and cdr, which is always safe to share because cells are
+// never mutated. The table holds the Refs of conses, keyed by their contents,
+// with open addressing and linear probing. It is weak: every collection
+// rebuilds it from the entries that survived, at their new addresses.
+bool hash_cons = false;
 
-    // Link up the free list
-    for (size_t i = 0; i < HEAP_SIZE - 1; ++i) {
-        heap[i].pair.cdr = &heap[i + 1];
-    }
-    heap[HEAP_SIZE - 1].pair.cdr = nullptr;
-    free_list = &heap[0];
+const Ref EMPTY_SLOT = ~Ref(0);
+const size_t MIN_CONS_TABLE = 1024;
 
-    heap_initialized = true;
+std::vector<Ref> cons_table;
+size_t cons_table_count = 0;
 
-    // Create constants
-    // We must manually init nil and truth to avoid infinite recursion or checks if we used make_symbol inside init_memory logic differently.
-    // But make_symbol calls init_memory if not initialized.
-    // We set flag true first, so it's safe.
+inline size_t cons_hash(Ref car, Ref cdr) {
+    uint64_t k = (uint64_t(car) << 32 | cdr) * 0x9E3779B97F4A7C15ull;
+    return size_t(k >> 32) & (cons_table.size() - 1);
+}
 
-    nil = make_symbol("nil");
-    truth = make_symbol("t");
+// The slot holding the cons of car and cdr, or the empty slot where it would go.
+inline size_t cons_slot(Ref car, Ref cdr) {
+    size_t i = cons_hash(car, cdr);
+    for (;;) {
+        Ref r = cons_table[i];
+        if (r == EMPTY_SLOT) return i;
+        Cell* c = cell_at(r);
+        if (c->car == car && c->cdr == cdr) return i;
+        i = (i + 1) & (cons_table.size() - 1);
+    }
 }
 
-bool is_symbol(Cell* c) {
-    return c && c->type == Cell::SYMBOL;
+// Add a cons whose contents are (car, cdr), without checking for a duplicate.
+void insert_cons(Ref r, Ref car, Ref cdr) {
+    size_t i = cons_hash(car, cdr);
+    while (cons_table[i] != EMPTY_SLOT) {
+        i = (i + 1) & (cons_table.size() - 1);
+    }
+    cons_table[i] = r;
+    cons_table_count++;
 }
 
-bool is_cons(Cell* c) {
-    return c && c->type == Cell::CONS;
+// Rebuild the table from the entries that 'survivor' maps to a Ref, dropping
+// those it maps to EMPTY_SLOT, and size it to be at most a quarter full.
+// 'contents' returns the cell at a new Ref, which need not be in the heap yet.
+template <typename F, typename G>
+void rebuild_cons_table(F survivor, G contents) {
+    std::vector<Ref> kept;
+    for (Ref r : cons_table) {
+        if (r == EMPTY_SLOT) continue;
+        Ref n = survivor(r);
+        if (n != EMPTY_SLOT) kept.push_back(n);
+    }
+
+    size_t size = MIN_CONS_TABLE;
+    while (size < 4 * kept.size()) size *= 2;
+    cons_table.assign(size, EMPTY_SLOT);
+    cons_table_count = 0;
+    for (Ref n : kept) {
+        const Cell& c = contents(n);
+        insert_cons(n, c.car, c.cdr);
+    }
 }
 
-// -----------------------------------------------------------------------------
-// Unit Tests
-// -----------------------------------------------------------------------------
+// Drop the entries for cells left unmarked by a collection.
+void prune_cons_table() {
+    if (cons_table_count == 0) return;
+    rebuild_cons_table([](Ref r) { return is_marked(r) ? r : EMPTY_SLOT; },
+                       [](Ref n) -> const Cell& { return *cell_at(n); });
+}
 
-TEST_CASE("Memory: Initialization and Symbols") {
-    init_memory();
-    CHECK(nil != nullptr);
-    CHECK(truth != nullptr);
-    CHECK(is_symbol(nil));
-    CHECK(is_symbol(truth));
-    CHECK(*nil->symbol_name == "nil");
-    CHECK(*truth->symbol_name == "t");
+// Drop the symbols that 'survivor' maps to EMPTY_SLOT and renumber the rest in
+// order, rebuilding the atom table. 'survivor' gives each symbol's Ref after
+// the collection, and 'contents' the cell at that Ref, which need not be in
+// the heap yet. Once most of the name arena is dead, the live names are
+// packed into fresh blocks.
+template <typename F, typename G>
+void prune_symbols(F survivor, G contents) {
+    size_t kept = 0;
+    size_t name_bytes = 0;
+    for (size_t i = 0; i < symbols.size(); ++i) {
+        Symbol& sym = symbols[i];
+        Ref n = sym.duplicate ? EMPTY_SLOT : survivor(sym);
+        if (n == EMPTY_SLOT) continue;
+        contents(n).car = SYMBOL_TAG | Ref(kept);
+        sym.cell = cell_at(n);
+        name_bytes += sym.name.size();
+        symbols[kept++] = sym;
+    }
+    if (kept == symbols.size()) {
+        // Still free the tables replaced since the last collection.
+        atom_tables.erase(atom_tables.begin(), atom_tables.end() - 1);
+        return;
+    }
+
+    if (gc_trace) {
+        std::cout << "[GC] Symbols reclaimed: " << symbols.size() - kept << "\n";
+    }
+    symbols.resize(kept);
+
+    if (name_arena_size > 2 * name_bytes + NAME_BLOCK_SIZE) {
+        std::vector<std::unique_ptr<char[]>> old_blocks;
+        old_blocks.swap(name_blocks);
+        name_block_used = NAME_BLOCK_SIZE;
+        name_arena_size = 0;
+        for (size_t i = 0; i < symbols.size(); ++i) {
+            Symbol& sym = symbols[i];
+            sym.name = store_name(sym.name);
+        }
+    }
+    rehash_atoms();
 }
 
-TEST_CASE("Memory: Interning") {
-    Cell* s1 = make_symbol("foo");
-    Cell* s2 = make_symbol("foo");
-    Cell* s3 = make_symbol("bar");
+// Drop the symbols left unmarked by a collection.
+void prune_unmarked_symbols() {
+    prune_symbols([](const Symbol& sym) {
+        Ref r = ref_of(sym.cell);
+        return is_marked(r) ? r : EMPTY_SLOT;
+    }, [](Ref n) -> Cell& { return *cell_at(n); });
+}
 
-    CHECK(s1 == s2);
-    CHECK(s1 != s3);
-    CHECK(*s1->symbol_name == "foo");
+// A run of bitmap words swept into its own list of free runs.
+struct SweepSegment {
+    size_t first_word = 0;
+    size_t end_word = 0;
+    std::vector<FreeRun> runs;
+    size_t reclaimed = 0;
+    size_t in_use = 0;
+};
+
+void sweep_segment(SweepSegment& seg) {
+    // Scan the bitmap a word (64 cells) at a time, using ctz to jump from one
+    // live/dead boundary to the next, and record each run of dead cells.
+    // Runs may continue from one word into the next.
+    bool open = false;
+    size_t run_begin = 0;
+
+    for (size_t w = seg.first_word; w < seg.end_word; ++w) {
+        size_t base = w * 64;
+        size_t count = std::min<size_t>(64, heap_size - base);
+        uint64_t valid = (count == 64) ? ~uint64_t(0) : ((uint64_t(1) << count) - 1);
+        uint64_t live = mark_bits[w];
+        uint64_t dead = ~live & valid;
+
+        seg.in_use += __builtin_popcountll(live);
+        seg.reclaimed += __builtin_popcountll(dead);
+
+        // Fully live or fully dead words need no bit scanning.
+        if (dead == valid && count == 64) {
+            if (!open) {
+                open = true;
+                run_begin = base;
+            }
+            continue;
+        }
+        if (!dead) {
+            if (open) {
+                seg.runs.push_back({Ref(run_begin), Ref(base)});
+                open = false;
+            }
+            continue;
+        }
+
+        size_t b = 0;
+        while (b < count) {
+            uint64_t rest = dead >> b;
+            if (open) {
+                b += __builtin_ctzll(~rest);
+                if (b >= count) break;
+                seg.runs.push_back({Ref(run_begin), Ref(base + b)});
+                open = false;
+            } else {
+                if (!rest) break;
+                b += __builtin_ctzll(rest);
+                run_begin = base + b;
+                open = true;
+            }
+        }
+    }
+    if (open) {
+        seg.runs.push_back({Ref(run_begin), Ref(std::min(seg.end_word * 64, heap_size))});
+    }
+
+    // Reset this segment's marks for next time.
+    std::memset(&mark_bits[seg.first_word], 0, (seg.end_word - seg.first_word) * sizeof(uint64_t));
 }
 
-TEST_CASE("Memory: Cons") {
-    Cell* s1 = make_symbol("a");
-    Cell* s2 = make_symbol("b");
-    Cell* c = cons(s1, s2);
+// Forget all free runs, ready for a new sweep.
+void reset_free_runs() {
+    free_runs.clear();
+    next_run = 0;
+    alloc_top = alloc_end = 0;
+}
 
-    CHECK(is_cons(c));
-    CHECK(c->pair.car == s1);
-    CHECK(c->pair.cdr == s2);
+// Sweep function
+void sweep() {
+    // Rebuild the free runs below the frontier from scratch. With several GC
+    // threads, each sweeps its own slice of the heap, and the slices' runs are
+    // joined in address order, merging runs that meet at a slice boundary.
+    size_t n = std::max(gc_threads, 1);
+    size_t words = frontier / 64;
+    std::vector<SweepSegment> segs(n);
+    for (size_t i = 0; i < n; ++i) {
+        segs[i].first_word = words * i / n;
+        segs[i].end_word = words * (i + 1) / n;
+    }
+    run_parallel(n, [&](size_t i) { sweep_segment(segs[i]); });
+
+    size_t reclaimed = 0;
+    size_t in_use = 0;
+    reset_free_runs();
+    for (SweepSegment& seg : segs) {
+        for (const FreeRun& run : seg.runs) {
+            if (!free_runs.empty() && free_runs.back().end == run.begin) {
+                free_runs.back().end = run.end;
+            } else {
+                free_runs.push_back(run);
+            }
+        }
+        reclaimed += seg.reclaimed;
+        in_use += seg.in_use;
+    }
+
+    free_count = reclaimed + (heap_size - frontier);
+
+    // The nursery is marked through but never swept; reset its marks too.
+    clear_nursery_marks();
+
+    if (gc_trace) {
+        std::cout << "[GC] Reclaimed: " << reclaimed << ", In use: " << in_use << "\n";
+    }
 }
 
-TEST_CASE("Memory: Garbage Collection") {
-    // We need to simulate filling the heap.
-    // Since heap is large (1M), we can't easily fill it in a quick test.
-    // But we can verify that things are marked/swept if we manually trigger GC.
+// Sweep the next block of a pending lazy sweep, adding its free runs.
+// Returns false if the whole heap has already been swept.
+bool sweep_next_block() {
+    if (sweep_cursor >= sweep_end) return false;
+    Clock::time_point start = keeping_stats() ? Clock::now() : Clock::time_point();
 
-    gc_trace = false; // Silence output
+    SweepSegment seg;
+    seg.first_word = sweep_cursor;
+    seg.end_word = std::min(sweep_cursor + SWEEP_BLOCK_WORDS, sweep_end);
+    sweep_cursor = seg.end_word;
+    sweep_segment(seg);
 
-    Cell* s1 = make_symbol("keep");
-    Cell* c1 = cons(s1, nil);
+    free_runs.insert(free_runs.end(), seg.runs.begin(), seg.runs.end());
+    if (keeping_stats() && sweep_record < gc_records.size()) {
+        gc_records[sweep_record].sweep_ms += ms_since(start);
+    }
+    return true;
+}
 
-    // c1 is a root.
-    gc({c1});
+// Drop the rest of a pending lazy sweep. Its stale marks are cleared; the
+// dead cells it held are found again by the next sweep.
+void discard_pending_sweep() {
+    if (sweep_cursor >= sweep_end) return;
+    std::memset(&mark_bits[sweep_cursor], 0, (sweep_end - sweep_cursor) * sizeof(uint64_t));
+    sweep_cursor = sweep_end;
+}
 
-    // c1 should still be valid.
-    CHECK(c1->type == Cell::CONS);
-    CHECK(c1->pair.car == s1);
+void shrink_if_sparse(size_t live, size_t top);
 
-    // Allocate something that we drop.
-    Cell* garbage = cons(make_symbol("trash"), nil);
-    (void)garbage; // Suppress unused warning
+// Finish marking. Sweeping is left to alloc_raw(), unless several GC threads
+// are available to do it all at once. Either way the pause ends here.
+// Returns the number of live cells.
+size_t begin_sweep() {
+    prune_cons_table();
+    prune_unmarked_symbols();
 
-    // Trigger GC without including 'garbage' in roots.
-    // 'garbage' should be reclaimed.
+    // Count the live cells and find the last of them, in case the heap can
+    // shrink down to it first.
+    size_t in_use = 0;
+    size_t top = 0;
+    for (size_t w = 0; w < frontier / 64; ++w) {
+        if (mark_bits[w]) {
+            in_use += __builtin_popcountll(mark_bits[w]);
+            top = (w + 1) * 64;
+        }
+    }
+    shrink_if_sparse(in_use, top);
+
+    if (gc_threads > 1) {
+        sweep();
+        return in_use;
+    }
+
+    sweep_end = frontier / 64;
+    reset_free_runs();
+    free_count = heap_size - in_use;
+    sweep_cursor = 0;
+
+    // The nursery is marked through but never swept; reset its marks now.
+    clear_nursery_marks();
+
+    if (gc_trace) {
+        std::cout << "[GC] Reclaimed: " << free_count << ", In use: " << in_use << "\n";
+    }
+    return in_use;
+}
+
+void collect_bump_heap();
+void copy_gc();
+
+size_t chunk_round(size_t cells) {
+    return (cells + HEAP_CHUNK - 1) / HEAP_CHUNK * HEAP_CHUNK;
+}
+
+// Grow the main heap to at least 'cells' cells, rounded up to whole chunks
+// and capped at heap_max. Returns false if it is already as large as that.
+bool grow_heap(size_t cells) {
+    size_t target = std::min(chunk_round(cells), heap_max);
+    if (target <= heap_size) return false;
+    ++alloc_epoch;
+
+    size_t old_size = heap_size;
+    if (gc_trace) {
+        std::cout << "[GC] Heap grown: " << old_size << " -> " << target << " cells\n";
+    }
+
+    if (gc_mode == GC_COPYING) {
+        // The semispace boundary moves up. If the live cells are in the upper
+        // semispace, copy them down into the new lower one.
+        heap_size = target;
+        if (space_lo == 0) {
+            alloc_end = heap_size / 2;
+        } else {
+            copy_gc();
+        }
+        return true;
+    }
+
+    if (gc_mode == GC_COMPACT) {
+        heap_size = target;
+        alloc_end = heap_size;
+        return true;
+    }
+
+    // The new cells lie beyond the frontier, which can now advance into them.
+    heap_size = target;
+    free_count += heap_size - old_size;
+    return true;
+}
+
+// Growth policy, applied after each collection of the main heap.
+void grow_if_crowded(size_t live) {
+    size_t spaces = (gc_mode == GC_COPYING) ? 2 : 1;
+    if (live > heap_size / spaces * HEAP_TARGET_LIVE) {
+        grow_heap(spaces * size_t(live / HEAP_TARGET_LIVE));
+    }
+}
+
+// Hand the pages of cells [begin, end) back to the OS. They read as zero if
+// touched again.
+void release_cells(size_t begin, size_t end) {
+    uintptr_t lo = (reinterpret_cast<uintptr_t>(heap + begin) + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+    uintptr_t hi = reinterpret_cast<uintptr_t>(heap + end) & ~(HUGE_PAGE - 1);
+    if (lo < hi) {
+        madvise(reinterpret_cast<void*>(lo), hi - lo, MADV_DONTNEED);
+    }
+}
+
+// Shrinking policy, applied once a collection knows how many cells are live
+// and that every cell from 'top' up is free. A sparse heap shrinks so that the
+// live cells fill half of HEAP_TARGET_LIVE, which leaves room to grow before
+// the growth policy applies again.
+void shrink_if_sparse(size_t live, size_t top) {
+    size_t spaces = (gc_mode == GC_COPYING) ? 2 : 1;
+    if (live >= heap_size / spaces * HEAP_TARGET_LIVE / 4) return;
+
+    size_t target = std::max({chunk_round(spaces * size_t(2 * live / HEAP_TARGET_LIVE)), chunk_round(top), heap_initial});
+    if (target >= heap_size) return;
+
+    if (gc_trace) {
+        std::cout << "[GC] Heap shrunk: " << heap_size << " -> " << target << " cells\n";
+    }
+    release_cells(target, heap_size);
+    heap_size = target;
+
+    if (gc_mode == GC_COPYING) {
+        alloc_end = heap_size / 2;
+    } else if (gc_mode == GC_COMPACT) {
+        alloc_end = heap_size;
+    } else {
+        frontier = std::min(frontier, heap_size);
+    }
+}
+
+// Call f on each variable registered with a Root, innermost first.
+template <typename F>
+void for_each_root_slot(F f) {
+    for (Root* r = root_top; r; r = r->prev) {
+        f(r->slot);
+    }
+}
+
+// Call f on the registered roots, the global constants and the atom table.
+template <typename F>
+void for_each_root(F f) {
+    for_each_root_slot([&](Cell** slot) { f(*slot); });
+
+    // Global constants
+    f(nil);
+    f(truth);
+
+    // Pinned symbols. The rest of the atom table is weak.
+    for (size_t i = 0; i < symbols.size(); ++i) {
+        Symbol& sym = symbols[i];
+        if (sym.pinned) f(sym.cell);
+    }
+}
+
+// Mark everything reachable from the roots.
+void mark_roots() {
+    discard_pending_sweep();
+
+    if (gc_threads > 1) {
+        std::vector<Ref> refs;
+        for_each_root([&](Cell* c) {
+            if (c) refs.push_back(ref_of(c));
+        });
+        parallel_mark(refs);
+        return;
+    }
+
+    for_each_root(mark);
+}
+
+// Start a background mark from a snapshot of the current roots.
+// Cells are never mutated after cons() returns, so whatever was reachable from
+// the snapshot stays reachable by the same paths until the cycle ends, and
+// the marker needs no write barrier. Anything eval can reach later is either
+// in that snapshot or allocated during the cycle, and those cells are
+// allocated marked.
+void start_background_mark() {
+    ++alloc_epoch;
+    // The marker shares the bitmap, so no block may be swept while it runs.
+    // Finish any pending sweep now, so that every free cell is on the list.
+    while (sweep_next_block()) {}
+
+    std::vector<Ref> refs;
+    for_each_root([&](Cell* c) {
+        if (c) refs.push_back(ref_of(c));
+    });
+
+    background.done = false;
+    background.active = true;
+    background.thread = std::thread([](std::vector<Ref> stack) {
+        Clock::time_point start = Clock::now();
+        while (!stack.empty()) {
+            Ref r = stack.back();
+            stack.pop_back();
+            mark_chain_atomic(r, stack);
+        }
+        background.mark_ms = ms_since(start);
+        background.done = true;
+    }, std::move(refs));
+}
+
+// Wait for the background mark and sweep with its result. The current roots
+// are marked on top, in case they predate the snapshot without being
+// reachable from it.
+void finish_background_mark() {
+    ++alloc_epoch;
+    size_t used = heap_size - free_count;
+    Clock::time_point start = Clock::now();
+    background.thread.join();
+    background.active = false;
+
+    for_each_root(mark);
+    double remark_ms = ms_since(start);
+    Clock::time_point sweep_start = Clock::now();
+    size_t live = begin_sweep();
+    record_gc("concurrent", ms_since(start), background.mark_ms + remark_ms,
+              ms_since(sweep_start), used, live);
+    sweep_record = gc_records.size() - 1;
+    grow_if_crowded(heap_size - free_count);
+}
+
+// Abandon a background mark, e.g. before the heap is laid out again.
+void cancel_background_mark() {
+    if (!background.active) return;
+    background.thread.join();
+    background.active = false;
+    clear_marks();
+}
+
+// Garbage Collection Entry Point
+void gc() {
+    ++alloc_epoch;
+    if (bump_allocating()) {
+        collect_bump_heap();
+        return;
+    }
+
+    if (background.active) {
+        // Only fall back to a stop-the-world collection if the finished
+        // cycle freed nothing.
+        finish_background_mark();
+        if (free_count > 0) return;
+    }
+
+    size_t used = heap_size - free_count;
+    Clock::time_point start = Clock::now();
+    mark_roots();
+    double mark_ms = ms_since(start);
+    Clock::time_point sweep_start = Clock::now();
+    size_t live = begin_sweep();
+    record_gc("full", ms_since(start), mark_ms, ms_since(sweep_start), used, live);
+    sweep_record = gc_records.size() - 1;
+    grow_if_crowded(heap_size - free_count);
+}
+
+// Copy a nursery cell onto the main heap, leaving a forwarding address behind.
+// Cells outside the nursery are returned unchanged. Newly promoted cells are
+// queued on 'scan' so that their own fields get promoted in turn.
+Ref promote(Ref r, std::vector<Ref>& scan) {
+    if (r < heap_max || r >= heap_max + NURSERY_SIZE) return r;
+
+    Cell* c = cell_at(r);
+    if (c->car == FORWARD_TAG) return c->cdr;
+
+    Cell* n = alloc_raw();
+    if (!n) {
+        std::cerr << "Fatal Error: Heap exhausted (promotion).\n";
+        exit(1);
+    }
+    *n = *c;
+
+    c->car = FORWARD_TAG;
+    c->cdr = ref_of(n);
+    scan.push_back(c->cdr);
+    return c->cdr;
+}
+
+// Minor collection: evacuate the live part of the nursery onto the main heap.
+// Cells are never mutated after cons() returns, so an older cell cannot point
+// at a younger one. The registered roots are therefore the only references
+// into the nursery, and no write barrier or remembered set is needed.
+void minor_gc() {
+    ++alloc_epoch;
+    size_t used = nursery_top - heap_max;
+
+    // Make sure the main heap can absorb the worst case of every cell surviving.
+    if (free_count < used) {
+        gc();
+    }
+    if (free_count < used) {
+        grow_heap(heap_size + used - free_count);
+    }
+    size_t free_before = free_count;
+    Clock::time_point start = Clock::now();
+
+    std::vector<Ref> scan;
+    for_each_root_slot([&](Cell** slot) {
+        if (*slot) *slot = cell_at(promote(ref_of(*slot), scan));
+    });
+    while (!scan.empty()) {
+        Cell* c = cell_at(scan.back());
+        scan.pop_back();
+        c->car = promote(c->car, scan);
+        c->cdr = promote(c->cdr, scan);
+    }
+
+    size_t promoted = free_before - free_count;
+    double copy_ms = ms_since(start);
+    record_gc("minor", copy_ms, copy_ms, 0, used, promoted);
+    if (gc_trace) {
+        std::cout << "[GC] Minor: Promoted: " << promoted << ", Reclaimed: " << used - promoted << "\n";
+    }
+
+    // Promoted cells keep their entries at their new addresses.
+    if (cons_table_count > 0) {
+        rebuild_cons_table([](Ref r) {
+            if (r < heap_max) return r;
+            Cell* c = cell_at(r);
+            return (c->car == FORWARD_TAG) ? c->cdr : EMPTY_SLOT;
+        }, [](Ref n) -> const Cell& { return *cell_at(n); });
+    }
+
+    nursery_top = heap_max;
+}
+
+// Cheney-style evacuation shared by the copying collector and set_gc_mode().
+// Cells are copied into evac_to[], where the cell at offset i gets Ref evac_base + i.
+Cell* evac_to = nullptr;
+Ref evac_base = 0;
+size_t evac_top = 0;
+
+Ref evacuate_cell(Ref r) {
+    Cell* c = cell_at(r);
+    if (c->car == FORWARD_TAG) return c->cdr;
+
+    Ref n = evac_base + Ref(evac_top);
+    evac_to[evac_top++] = *c;
+    c->car = FORWARD_TAG;
+    c->cdr = n;
+    return n;
+}
+
+// Copy a cell and then the rest of its list spine, cdr first, so that the
+// spine lands contiguously. The copies still hold old Refs; the scan in
+// evacuate() forwards each field of each copy exactly once.
+Ref forward(Ref r) {
+    if (is_immortal_ref(r)) return r;
+    Cell* c = cell_at(r);
+    if (c->car == FORWARD_TAG) return c->cdr;
+    if (c->car & SYMBOL_TAG) return evacuate_cell(r);
+
+    Ref n = evacuate_cell(r);
+    for (;;) {
+        Ref next = evac_to[evac_top - 1].cdr;
+        if (is_immortal_ref(next)) break;
+        Cell* d = cell_at(next);
+        if (d->car == FORWARD_TAG || (d->car & SYMBOL_TAG)) break;
+        evacuate_cell(next);
+    }
+    return n;
+}
+
+Cell* forward_cell(Cell* c) {
+    return cell_at(forward(ref_of(c)));
+}
+
+// Deduplication. With gc_dedup set, every evacuation also merges structurally
+// identical conses: each cell's canonical copy is found bottom-up, from the
+// canonical copies of its car and cdr, and the canonical cells are then slid
+// down over the duplicates, keeping their order. Cells form a DAG, since they
+// are never mutated, so every cell has its children settled before itself.
+// Fills 'remap' with each copied cell's final Ref, indexed by its offset in
+// evac_to[], and returns the number of cells kept.
+bool gc_dedup = false;
+
+size_t dedup_evacuated(std::vector<Ref>& remap) {
+    size_t n = evac_top;
+    const Ref UNSET = ~Ref(0);
+    std::vector<Ref> canon(n, UNSET);
+
+    // Canonical cells, keyed by the canonical offsets of their fields.
+    size_t size = 1024;
+    while (size < 2 * n) size *= 2;
+    std::vector<Ref> table(size, UNSET);
+
+    auto offset = [](Ref r) { return r - evac_base; };
+
+    // Immortal cells are not copied and are their own canonical cells. Their
+    // Refs lie above every offset, so the two never collide.
+    auto canon_of = [&](Ref r) { return is_immortal_ref(r) ? r : canon[offset(r)]; };
+
+    std::vector<Ref> stack;
+    for (size_t i = 0; i < n; ++i) {
+        if (canon[i] != UNSET) continue;
+        stack.push_back(Ref(i));
+        while (!stack.empty()) {
+            Ref k = stack.back();
+            const Cell& c = evac_to[k];
+            if (c.car & SYMBOL_TAG) {
+                canon[k] = k;
+                stack.pop_back();
+                continue;
+            }
+
+            Ref a = canon_of(c.car);
+            Ref d = canon_of(c.cdr);
+            if (a == UNSET || d == UNSET) {
+                if (a == UNSET) stack.push_back(offset(c.car));
+                if (d == UNSET) stack.push_back(offset(c.cdr));
+                continue;
+            }
+            stack.pop_back();
+            if (canon[k] != UNSET) continue;
+
+            uint64_t key = (uint64_t(a) << 32 | d) * 0x9E3779B97F4A7C15ull;
+            size_t slot = size_t(key >> 32) & (size - 1);
+            for (;;) {
+                Ref t = table[slot];
+                if (t == UNSET) {
+                    table[slot] = k;
+                    canon[k] = k;
+                    break;
+                }
+                const Cell& u = evac_to[t];
+                if (canon_of(u.car) == a && canon_of(u.cdr) == d) {
+                    canon[k] = t;
+                    break;
+                }
+                slot = (slot + 1) & (size - 1);
+            }
+        }
+    }
+
+    // Slide the canonical cells down, rewriting their fields as they go.
+    // A cell only ever moves down, past cells that have already moved.
+    std::vector<Ref> slid(n);
+    size_t kept = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (canon[i] == i) slid[i] = Ref(kept++);
+    }
+    remap.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        remap[i] = evac_base + slid[canon[i]];
+    }
+    auto remapped = [&](Ref r) { return is_immortal_ref(r) ? r : remap[offset(r)]; };
+    for (size_t i = 0; i < n; ++i) {
+        if (canon[i] != i) continue;
+        Cell c = evac_to[i];
+        if (!(c.car & SYMBOL_TAG)) {
+            c.car = remapped(c.car);
+            c.cdr = remapped(c.cdr);
+        }
+        evac_to[slid[i]] = c;
+    }
+
+    auto update = [&](Cell*& c) { c = cell_at(remapped(ref_of(c))); };
+    for_each_root_slot([&](Cell** slot) {
+        if (*slot) update(*slot);
+    });
+    update(nil);
+    update(truth);
+    for (size_t i = 0; i < symbols.size(); ++i) {
+        Symbol& sym = symbols[i];
+        update(sym.cell);
+    }
+
+    evac_top = kept;
+    return kept;
+}
+
+// Copy everything reachable from the roots into evac_to[] and update the roots.
+// Returns the number of cells copied.
+size_t evacuate(Cell* to, Ref base) {
+    evac_to = to;
+    evac_base = base;
+    evac_top = 0;
+
+    for_each_root_slot([](Cell** slot) {
+        if (*slot) *slot = forward_cell(*slot);
+    });
+    nil = forward_cell(nil);
+    truth = forward_cell(truth);
+    for (size_t i = 0; i < symbols.size(); ++i) {
+        Symbol& sym = symbols[i];
+        if (sym.pinned) sym.cell = forward_cell(sym.cell);
+    }
+
+    for (size_t scan = 0; scan < evac_top; ++scan) {
+        Cell* c = &evac_to[scan];
+        if (c->car & SYMBOL_TAG) continue;
+        c->car = forward(c->car);
+        c->cdr = forward(c->cdr);
+    }
+
+    // Symbols that were not copied are dropped; the rest move with their
+    // cells. Immortal symbols stay where they are.
+    prune_symbols([](const Symbol& sym) {
+        Ref r = ref_of(sym.cell);
+        if (sym.pinned || is_immortal_ref(r)) return r;
+        return (sym.cell->car == FORWARD_TAG) ? sym.cell->cdr : EMPTY_SLOT;
+    }, [](Ref n) -> Cell& {
+        return is_immortal_ref(n) ? *cell_at(n) : evac_to[n - evac_base];
+    });
+
+    std::vector<Ref> remap;
+    if (gc_dedup) {
+        dedup_evacuated(remap);
+    }
+
+    // Conses that were copied keep their entries, keyed by their new contents.
+    if (cons_table_count > 0) {
+        rebuild_cons_table([&](Ref r) {
+            Cell* c = cell_at(r);
+            if (c->car != FORWARD_TAG) return EMPTY_SLOT;
+            return remap.empty() ? c->cdr : remap[c->cdr - evac_base];
+        }, [](Ref n) -> const Cell& { return evac_to[n - evac_base]; });
+    }
+    return evac_top;
+}
+
+// Copying collection: evacuate the current semispace into the other one.
+// The cost is proportional to the live cells, not to the size of the heap.
+void copy_gc() {
+    size_t used = alloc_top - space_lo;
+    size_t semispace = heap_size / 2;
+    size_t to_lo = (space_lo == 0) ? semispace : 0;
+
+    Clock::time_point start = Clock::now();
+    size_t live = evacuate(&heap[to_lo], Ref(to_lo));
+    double copy_ms = ms_since(start);
+    record_gc("copying", copy_ms, copy_ms, 0, used, live);
+
+    space_lo = to_lo;
+    alloc_top = to_lo + live;
+    alloc_end = to_lo + semispace;
+
+    if (gc_trace) {
+        std::cout << "[GC] Reclaimed: " << used - live << ", In use: " << live << "\n";
+    }
+}
+
+// Mark-compact collection. After marking, every live cell is moved to the
+// bottom of the heap in the same cdr-first order the copying collector uses,
+// so each list spine ends up consecutive and allocation resumes by bumping
+// a pointer over the free space above it. Marking first lets the temporary
+// copy be sized to the live data rather than to the heap.
+void compact_gc() {
+    size_t used = alloc_top;
+
+    Clock::time_point start = Clock::now();
+    mark_roots();
+    double mark_ms = ms_since(start);
+    Clock::time_point compact_start = Clock::now();
+    size_t live = 0;
+    for (size_t w = 0; w < heap_words(); ++w) {
+        live += __builtin_popcountll(mark_bits[w]);
+    }
+    clear_marks();
+
+    std::vector<Cell> compacted(live);
+    live = evacuate(compacted.data(), 0);
+    if (live) std::memcpy(heap, compacted.data(), live * sizeof(Cell));
+
+    alloc_top = live;
+    alloc_end = heap_size;
+    record_gc("compact", ms_since(start), mark_ms, ms_since(compact_start), used, live);
+
+    if (gc_trace) {
+        std::cout << "[GC] Reclaimed: " << used - live << ", In use: " << live << "\n";
+    }
+}
+
+void collect_bump_heap() {
+    ++alloc_epoch;
+    if (gc_mode == GC_COPYING) {
+        copy_gc();
+    } else {
+        compact_gc();
+    }
+
+    size_t live = alloc_top - space_lo;
+    grow_if_crowded(live);
+
+    // A copying heap can only shrink while its cells are in the lower semispace.
+    if (space_lo == 0) {
+        shrink_if_sparse(live, (gc_mode == GC_COPYING) ? 2 * alloc_top : alloc_top);
+    }
+}
+
+// Allocate a new cell holding car and cdr.
+Cell* fresh_cons(Cell* car, Cell* cdr) {
+    if (gc_mode == GC_CONCURRENT) {
+        if (background.active && background.done) {
+            finish_background_mark();
+        } else if (!background.active && concurrent_start_due()) {
+            Root r_car(car), r_cdr(cdr);
+            start_background_mark();
+        }
+    }
+
+    Cell* c = alloc_local();
+    if (!c) {
+        // Attempt GC: a minor one when the nursery is full, or a full one.
+        // We protect car and cdr.
+        Root r_car(car), r_cdr(cdr);
+        if (bump_allocating()) {
+            collect_bump_heap();
+        } else if (gc_mode == GC_GENERATIONAL) {
+            minor_gc();
+        } else {
+            gc();
+        }
+        c = alloc_local();
+        if (!c && grow_heap(heap_size + 1)) c = alloc_local();
+        if (!c) {
+            std::cerr << "Fatal Error: Heap exhausted (cons).\n";
+            exit(1);
+        }
+    }
+
+    c->car = ref_of(car);
+    c->cdr = ref_of(cdr);
+    return c;
+}
+
+Cell* cons(Cell* car, Cell* cdr) {
+    if (!heap_initialized) init_memory();
+    if (!hash_cons) return fresh_cons(car, cdr);
+
+    if (cons_table.empty()) {
+        cons_table.assign(MIN_CONS_TABLE, EMPTY_SLOT);
+    }
+
+    size_t i = cons_slot(ref_of(car), ref_of(cdr));
+    if (cons_table[i] != EMPTY_SLOT) {
+        Ref r = cons_table[i];
+
+        // The cell may have been unreachable when a background mark took its
+        // snapshot. It is reachable again now, so mark it and everything
+        // under it, as if it had just been allocated.
+        if (background.active) {
+            std::vector<Ref> stack{r};
+            while (!stack.empty()) {
+                Ref next = stack.back();
+                stack.pop_back();
+                mark_chain_atomic(next, stack);
+            }
+        }
+        return cell_at(r);
+    }
+
+    // Allocating may collect and move car and cdr, so key the new entry on
+    // the contents of the new cell.
+    Cell* c = fresh_cons(car, cdr);
+    if (2 * (cons_table_count + 1) > cons_table.size()) {
+        rebuild_cons_table([](Ref r) { return r; }, [](Ref n) -> const Cell& { return *cell_at(n); });
+    }
+    insert_cons(ref_of(c), c->car, c->cdr);
+    return c;
+}
+
+// Take n consecutive cells from this thread's buffer, or from wherever its
+// next refill would come from, or from the frontier, without collecting.
+// Returns nullptr if there is no such room.
+Cell* alloc_block(size_t n) {
+    if (tlab_current() && tlab.end - tlab.top >= n) {
+        Cell* block = &heap[tlab.top];
+        tlab.top += n;
+        return block;
+    }
+
+    std::lock_guard<std::mutex> guard(heap_lock);
+    if (bump_allocating()) {
+        if (alloc_end - alloc_top < n) return nullptr;
+        Cell* block = &heap[alloc_top];
+        alloc_top += n;
+        count_allocated(n);
+        return block;
+    }
+
+    if (gc_mode == GC_GENERATIONAL) {
+        if (heap_max + NURSERY_SIZE - nursery_top < n) return nullptr;
+        Cell* block = &heap[nursery_top];
+        nursery_top += n;
+        count_allocated(n);
+        return block;
+    }
+
+    Ref r;
+    if (alloc_end - alloc_top >= n) {
+        r = Ref(alloc_top);
+        alloc_top += n;
+    } else if (heap_size - frontier >= n) {
+        // Leave the current run for later conses. The cells between the end
+        // of the block and the new frontier are found again by the next sweep.
+        r = Ref(frontier);
+        frontier = std::min((frontier + n + 63) / 64 * 64, heap_size);
+    } else {
+        return nullptr;
+    }
+    free_count -= n;
+    mark_allocated(r, n);
+    count_allocated(n);
+    return cell_at(r);
+}
+
+Cell* make_list(Cell** const* items, size_t n, Cell* tail) {
+    if (!heap_initialized) init_memory();
+
+    // Hash-consing must see every cons, so it always builds cell by cell.
+    Cell* block = hash_cons ? nullptr : alloc_block(n);
+    if (block) {
+        for (size_t i = 0; i < n; ++i) {
+            block[i].car = ref_of(*items[i]);
+            block[i].cdr = (i + 1 < n) ? ref_of(&block[i + 1]) : ref_of(tail);
+        }
+        return n ? block : tail;
+    }
+
+    Cell* list = tail;
+    Root r_list(list);
+    for (size_t i = n; i-- > 0;) {
+        list = cons(*items[i], list);
+    }
+    return list;
+}
+
+// Take n consecutive cells from the immortal region, or return nullptr if it
+// is full.
+Cell* alloc_immortal(size_t n) {
+    if (immortal_base + IMMORTAL_SIZE - immortal_top < n) return nullptr;
+    Cell* block = &heap[immortal_top];
+    immortal_top += n;
+    return block;
+}
+
+Cell* make_immortal_list(Cell** const* items, size_t n, Cell* tail) {
+    if (!heap_initialized) init_memory();
+
+    // Hash-consing must see every cons, and only indexes the heap. Everything
+    // the list points at must be immortal already.
+    bool immortal = !hash_cons && is_immortal(tail);
+    for (size_t i = 0; i < n; ++i) {
+        immortal = immortal && is_immortal(*items[i]);
+    }
+    Cell* block = immortal ? alloc_immortal(n) : nullptr;
+    if (!block) return make_list(items, n, tail);
+
+    for (size_t i = 0; i < n; ++i) {
+        block[i].car = ref_of(*items[i]);
+        block[i].cdr = (i + 1 < n) ? ref_of(&block[i + 1]) : ref_of(tail);
+    }
+    return n ? block : tail;
+}
+
+bool is_immortal(Cell* c) {
+    return is_immortal_ref(ref_of(c));
+}
+
+size_t immortal_mark() {
+    if (!heap_initialized) init_memory();
+    return immortal_top;
+}
+
+void release_immortal(size_t mark) {
+    if (mark >= immortal_top) return;
+
+    // The symbols made since the mark are normally the last in the table,
+    // with their names last in the arena, so they come off the end without
+    // renumbering any other symbol. No background marker reads them, since
+    // marking stops at immortal cells.
+    size_t made = 0;
+    for (size_t r = mark; r < immortal_top; ++r) {
+        if (heap[r].car & SYMBOL_TAG) ++made;
+    }
+    size_t keep = symbols.size();
+    size_t found = 0;
+    while (keep > 0 && ref_of(symbols[keep - 1].cell) >= mark) {
+        --keep;
+        if (!symbols[keep].duplicate) ++found;
+    }
+
+    if (found == made) {
+        AtomTable* t = atom_table.load(std::memory_order_acquire);
+        for (size_t i = symbols.size(); i-- > keep;) {
+            if (!symbols[i].duplicate) erase_atom(t, uint32_t(i));
+            unstore_name(symbols[i].name);
+        }
+        symbols.resize(keep);
+    } else {
+        // A heap symbol was made after some of them, as when the region
+        // filled up, so the rest are renumbered. That rewrites symbol cells a
+        // background marker may read, so its cycle is finished first.
+        if (background.active) finish_background_mark();
+        prune_symbols([mark](const Symbol& sym) {
+            Ref r = ref_of(sym.cell);
+            return (r >= mark) ? EMPTY_SLOT : r;
+        }, [](Ref n) -> Cell& { return *cell_at(n); });
+    }
+    immortal_top = mark;
+}
+
+// Find or make the symbol for name. A new symbol's cell comes from the
+// immortal region if 'immortal' is set and there is room.
+Cell* intern(std::string_view name, bool immortal) {
+    if (!heap_initialized) init_memory();
+
+    // Check if already exists
+    size_t hash = std::hash<std::string_view>()(name);
+    long found = find_atom(atom_table.load(std::memory_order_acquire), name, hash);
+    if (found >= 0) {
+        // The symbol may have been unreachable when a background mark took
+        // its snapshot. Mark it, or it would be swept while in use.
+        Cell* c = symbols[found].cell;
+        if (background.active) try_mark_atomic(ref_of(c));
+        return c;
+    }
+
+    uint32_t index;
+    {
+        std::lock_guard<std::mutex> guard(intern_lock);
+        std::lock_guard<std::mutex> heap_guard(heap_lock);
+
+        // Allocate new cell for symbol
+        Cell* c = immortal ? alloc_immortal(1) : nullptr;
+        if (!c) c = alloc_main();
+        if (!c) {
+            gc();
+            c = alloc_main();
+            if (!c && grow_heap(heap_size + 1)) c = alloc_main();
+            if (!c) {
+                 std::cerr << "Fatal Error: Heap exhausted (symbol).\n";
+                 exit(1);
+            }
+        }
+
+        if (!is_immortal(c)) count_allocated(1);
+        c->car = SYMBOL_TAG | Ref(symbols.size());
+        c->cdr = 0;
+        index = symbols.push_back({store_name(name), hash, c, false, false});
+    }
+
+    // Publish the symbol. If another thread got there first with the same
+    // name, use its symbol.
+    for (;;) {
+        AtomTable* t = atom_table.load(std::memory_order_acquire);
+        found = insert_atom(t, index);
+        if (found >= 0) {
+            if (t->count.load(std::memory_order_relaxed) > t->size * 7 / 8) {
+                grow_atoms(t);
+            }
+            break;
+        }
+        while (atom_table.load(std::memory_order_acquire) == t) {
+            std::this_thread::yield();
+        }
+    }
+
+    Cell* c = symbols[found].cell;
+    if (long(index) != found) {
+        // Ours is unreachable. Its record is dropped by the next collection,
+        // even from the immortal region, so that a rebuilt atom table cannot
+        // pick it over the winner. Its cell becomes an ordinary cons, which
+        // nothing, a saved image included, takes for a symbol.
+        Symbol& lost = symbols[index];
+        lost.duplicate = true;
+        lost.cell->car = lost.cell->cdr = ref_of(nil);
+        if (background.active) try_mark_atomic(ref_of(c));
+    }
+    return c;
+}
+
+Cell* make_symbol(std::string_view name) {
+    return intern(name, false);
+}
+
+Cell* make_immortal_symbol(std::string_view name) {
+    return intern(name, true);
+}
+
+std::string_view symbol_name(Cell* c) {
+    return symbols[c->car & ~SYMBOL_TAG].name;
+}
+
+void pin_symbol(Cell* c) {
+    symbols[c->car & ~SYMBOL_TAG].pinned = true;
+}
+
+// Allocator state saved by arena_begin(). Every cell handed out since lies
+// past these positions, in the calling thread's buffer, the nursery, the
+// current run, later free runs or beyond the frontier, so putting them back
+// frees all of it at once. Runs that lazy sweeping adds meanwhile are
+// appended to free_runs and stay put.
+struct ArenaMark {
+    size_t epoch;
+    Tlab tlab;
+    size_t alloc_top;
+    size_t alloc_end;
+    size_t next_run;
+    size_t frontier;
+    size_t free_count;
+    size_t nursery_top;
+    size_t symbols;
+};
+
+ArenaMark arena;
+
+void arena_begin() {
+    if (!heap_initialized) init_memory();
+    arena = {alloc_epoch, tlab, alloc_top, alloc_end, next_run, frontier,
+             free_count, nursery_top, symbols.size()};
+}
+
+bool arena_end() {
+    // A collection or relayout moves allocation somewhere the mark cannot
+    // describe, and a background mark may have marked the cells. Hash-consing
+    // and new heap symbols leave tables pointing at the cells.
+    if (arena.epoch != alloc_epoch || background.active || hash_cons ||
+        arena.symbols != symbols.size()) {
+        return false;
+    }
+
+    // Cells taken from the shared allocator, less those still in the buffer.
+    size_t taken = nursery_top - arena.nursery_top +
+        (bump_allocating() ? alloc_top - arena.alloc_top : arena.free_count - free_count);
+    size_t left_before = (arena.tlab.epoch == alloc_epoch) ? arena.tlab.end - arena.tlab.top : 0;
+    size_t left_now = tlab_current() ? tlab.end - tlab.top : 0;
+    size_t released = taken + left_before - left_now;
+    if (gc_trace) {
+        std::cout << "[GC] Arena released: " << released << "\n";
+    }
+
+    alloc_top = arena.alloc_top;
+    alloc_end = arena.alloc_end;
+    next_run = arena.next_run;
+    frontier = arena.frontier;
+    free_count = arena.free_count;
+    nursery_top = arena.nursery_top;
+    tlab = arena.tlab;
+    return true;
+}
+
+// Set up the allocator state for gc_mode, given that cells [0, live) are in
+// use and the rest of the heap is free.
+void layout_heap(size_t live) {
+    ++alloc_epoch;
+    // Make room for the live cells, and in copying mode for a second copy.
+    size_t needed = (gc_mode == GC_COPYING) ? 2 * live : live;
+    if (needed > heap_max) {
+        std::cerr << "Fatal Error: Heap exhausted (layout).\n";
+        exit(1);
+    }
+    heap_size = std::max(heap_size, chunk_round(needed));
+
+    nursery_top = heap_max;
+    discard_pending_sweep();
+
+    if (gc_mode == GC_COPYING) {
+        space_lo = 0;
+        alloc_top = live;
+        alloc_end = heap_size / 2;
+        return;
+    }
+
+    if (gc_mode == GC_COMPACT) {
+        space_lo = 0;
+        alloc_top = live;
+        alloc_end = heap_size;
+        return;
+    }
+
+    // The live cells are followed by a short free run up to a word boundary,
+    // where the frontier starts.
+    reset_free_runs();
+    frontier = std::min((live + 63) / 64 * 64, heap_size);
+    if (frontier > live) {
+        free_runs.push_back({Ref(live), Ref(frontier)});
+    }
+    free_count = heap_size - live;
+}
+
+void set_gc_mode(GcMode mode) {
+    if (!heap_initialized) {
+        gc_mode = mode;
+        return;
+    }
+
+    cancel_background_mark();
+
+    // Evacuate every live cell, wherever the old mode put it, to the bottom
+    // of the heap and lay out the rest for the new mode.
+    std::vector<Cell> scratch(heap_size + NURSERY_SIZE);
+    size_t live = evacuate(scratch.data(), 0);
+    std::memcpy(heap, scratch.data(), live * sizeof(Cell));
+
+    gc_mode = mode;
+    layout_heap(live);
+}
+
+// Map zero-filled, lazily committed memory, aligned to a huge page.
+void* reserve_pages(size_t bytes) {
+    void* p = mmap(nullptr, bytes + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        std::cerr << "Fatal Error: Could not reserve " << bytes << " bytes for the heap.\n";
+        exit(1);
+    }
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(p) + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+    return reinterpret_cast<void*>(aligned);
+}
+
+// Make nil and t, and pin them with the special forms.
+void make_constants() {
+    rehash_atoms();
+    nil = make_immortal_symbol("nil");
+    truth = make_immortal_symbol("t");
+
+    // The constants and the special forms are never collected. They live in
+    // the immortal region, so that program text using them can live there too.
+    for (std::string_view name : {"nil", "t", "quote", "cond", "lambda", "label"}) {
+        pin_symbol(make_immortal_symbol(name));
+    }
+}
+
+void init_memory() {
+    if (heap_initialized) return;
+
+    // Reserve address space for the largest heap allowed, plus the nursery
+    // and the immortal region above it. Nothing is written here, and with MAP_NORESERVE no memory is
+    // set aside either, so pages cost nothing until they are first touched.
+    heap_max = std::min(chunk_round(std::max(heap_max, heap_initial)), MAX_HEAP_CELLS / HEAP_CHUNK * HEAP_CHUNK);
+    heap_size = std::min(chunk_round(std::max<size_t>(heap_initial, 1)), heap_max);
+    heap_initial = heap_size;
+    start_time = Clock::now();
+    immortal_base = immortal_top = heap_max + NURSERY_SIZE;
+    heap = static_cast<Cell*>(reserve_pages((immortal_base + IMMORTAL_SIZE) * sizeof(Cell)));
+
+    // Back the heap with huge pages where the kernel allows it, to cut TLB
+    // misses while marking and walking lists. This is only advice, so a
+    // kernel without transparent huge pages is not an error.
+    madvise(heap, (immortal_base + IMMORTAL_SIZE) * sizeof(Cell), MADV_HUGEPAGE);
+    mark_bits = static_cast<uint64_t*>(reserve_pages((heap_max + NURSERY_SIZE) / 64 * sizeof(uint64_t)));
+
+    layout_heap(0);
+
+    heap_initialized = true;
+
+    // Create constants
+    // We must manually init nil and truth to avoid infinite recursion or checks if we used make_symbol inside init_memory logic differently.
+    // But make_symbol calls init_memory if not initialized.
+    // We set flag true first, so it's safe.
+    make_constants();
+}
+
+// Throw away every cell and symbol, and start again from the heap that
+// init_memory() made, as though nothing had run. For tests: no Root may be
+// registered, and no other thread may hold a cell.
+void reset_memory() {
+    if (!heap_initialized) {
+        init_memory();
+        return;
+    }
+    cancel_background_mark();
+
+    // Fresh zero pages replace the old ones, and any image mapped over the
+    // immortal region with them.
+    size_t heap_bytes = (immortal_base + IMMORTAL_SIZE) * sizeof(Cell);
+    size_t mark_bytes = (heap_max + NURSERY_SIZE) / 64 * sizeof(uint64_t);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED;
+    if (mmap(heap, heap_bytes, PROT_READ | PROT_WRITE, flags, -1, 0) == MAP_FAILED ||
+        mmap(mark_bits, mark_bytes, PROT_READ | PROT_WRITE, flags, -1, 0) == MAP_FAILED) {
+        std::cerr << "Fatal Error: Could not reset the heap.\n";
+        exit(1);
+    }
+    madvise(heap, heap_bytes, MADV_HUGEPAGE);
+
+    heap_size = heap_initial;
+    immortal_top = immortal_base;
+    layout_heap(0);
+    cons_table.clear();
+    cons_table_count = 0;
+    cells_allocated = total_allocated = 0;
+
+    symbols.resize(0);
+    name_blocks.clear();
+    name_block_used = NAME_BLOCK_SIZE;
+    name_arena_size = 0;
+    make_constants();
+}
+
+// Heap images. An image holds the immortal region and the symbols in it. An
+// immortal cell only points at other immortal cells, so the region is closed
+// and needs nothing from the collected heap. The file is laid out as:
+//
+//   ImageHeader, padded to IMAGE_ALIGN
+//   the region's cells, padded to IMAGE_ALIGN
+//   an ImageSymbol per symbol, in index order
+//   the symbols' names, back to back
+//
+// Cells keep their Refs as they were at immortal_base when the image was
+// saved. Symbols are renumbered densely, so a symbol cell's car is its index
+// in the image. Loading maps the cells straight over the region where the
+// page size allows, and only touches them if immortal_base has moved since.
+const size_t IMAGE_ALIGN = 4096;
+const char IMAGE_MAGIC[8] = {'A', 'L', 'I', 'M', 'G', 0, 0, 1};
+
+struct ImageHeader {
+    char magic[8];
+    uint64_t base;     // immortal_base when saved
+    uint64_t cells;    // cells in the region
+    uint64_t symbols;
+    uint64_t names;    // bytes of names
+    uint64_t roots;    // offset of the roots from base
+};
+
+struct ImageSymbol {
+    uint32_t cell;     // offset from base
+    uint32_t name;     // offset into the names
+    uint32_t size;
+    uint32_t pinned;
+};
+
+void pad_to_align(std::ofstream& out) {
+    static const char zeros[IMAGE_ALIGN] = {};
+    out.write(zeros, (IMAGE_ALIGN - out.tellp() % IMAGE_ALIGN) % IMAGE_ALIGN);
+}
+
+void save_image(const std::string& path, Cell* roots) {
+    if (!heap_initialized) init_memory();
+    if (!is_immortal(roots)) {
+        throw std::runtime_error("Image roots are not in the immortal region");
+    }
+
+    // Number the immortal symbols densely, in their current order.
+    std::vector<uint32_t> renumber(symbols.size());
+    std::vector<ImageSymbol> records;
+    std::string names;
+    for (size_t i = 0; i < symbols.size(); ++i) {
+        const Symbol& sym = symbols[i];
+        if (!is_immortal(sym.cell) || sym.duplicate) continue;
+        renumber[i] = uint32_t(records.size());
+        records.push_back({uint32_t(ref_of(sym.cell) - immortal_base), uint32_t(names.size()),
+                           uint32_t(sym.name.size()), sym.pinned});
+        names.append(sym.name);
+    }
+
+    size_t cells = immortal_top - immortal_base;
+    std::vector<Cell> region(&heap[immortal_base], &heap[immortal_top]);
+    for (Cell& c : region) {
+        if (c.car & SYMBOL_TAG) c.car = SYMBOL_TAG | renumber[c.car & ~SYMBOL_TAG];
+    }
+
+    ImageHeader header;
+    std::memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.base = immortal_base;
+    header.cells = cells;
+    header.symbols = records.size();
+    header.names = names.size();
+    header.roots = ref_of(roots) - immortal_base;
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    pad_to_align(out);
+    out.write(reinterpret_cast<const char*>(region.data()), cells * sizeof(Cell));
+    pad_to_align(out);
+    out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(ImageSymbol));
+    out.write(names.data(), names.size());
+    if (!out) {
+        throw std::runtime_error("Could not write image: " + path);
+    }
+}
+
+Cell* load_image(const std::string& path) {
+    if (!heap_initialized) init_memory();
+
+    // The image replaces the region and the symbol table wholesale, so only
+    // the pinned constants init_memory() made may exist yet: a cell or a
+    // symbol made since would be left pointing at whatever the image put in
+    // its place.
+    bool fresh = total_allocated + cells_allocated == 0 && immortal_top == immortal_base + symbols.size();
+    for (size_t i = 0; i < symbols.size() && fresh; ++i) {
+        fresh = symbols[i].pinned;
+    }
+    if (!fresh) {
+        throw std::runtime_error("Images must be loaded before anything is allocated: " + path);
+    }
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open image: " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < IMAGE_ALIGN) {
+        close(fd);
+        throw std::runtime_error("Not an image: " + path);
+    }
+    size_t size = st.st_size;
+
+    // The whole file stays mapped: symbol names point into it.
+    const char* file = static_cast<const char*>(mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0));
+    if (file == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("Could not map image: " + path);
+    }
+
+    ImageHeader header;
+    std::memcpy(&header, file, sizeof(header));
+    size_t cell_bytes = (header.cells * sizeof(Cell) + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+    size_t records_at = IMAGE_ALIGN + cell_bytes;
+    size_t names_at = records_at + header.symbols * sizeof(ImageSymbol);
+    if (std::memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 ||
+        header.cells > IMMORTAL_SIZE || header.roots >= header.cells ||
+        names_at + header.names != size) {
+        munmap(const_cast<char*>(file), size);
+        close(fd);
+        throw std::runtime_error("Not an image: " + path);
+    }
+    // Every Ref must stay inside the image, and every symbol cell and record
+    // must name each other, or a corrupt file would send car and cdr anywhere.
+    const Cell* cells = reinterpret_cast<const Cell*>(file + IMAGE_ALIGN);
+    const ImageSymbol* records = reinterpret_cast<const ImageSymbol*>(file + records_at);
+    const char* names = file + names_at;
+    bool valid = true;
+    for (size_t i = 0; i < header.cells && valid; ++i) {
+        const Cell& c = cells[i];
+        if (c.car & SYMBOL_TAG) {
+            Ref index = c.car & ~SYMBOL_TAG;
+            valid = index < header.symbols && records[index].cell == i;
+        } else {
+            valid = c.car - header.base < header.cells && c.cdr - header.base < header.cells;
+        }
+    }
+    for (size_t i = 0; i < header.symbols && valid; ++i) {
+        valid = records[i].cell < header.cells && cells[records[i].cell].car == (SYMBOL_TAG | Ref(i)) &&
+            size_t(records[i].name) + records[i].size <= header.names;
+    }
+    if (!valid) {
+        munmap(const_cast<char*>(file), size);
+        close(fd);
+        throw std::runtime_error("Corrupt image: " + path);
+    }
+
+    // Map the cells over the region, copy on write, or read them in if the
+    // region is not page-aligned.
+    Cell* region = &heap[immortal_base];
+    size_t page = sysconf(_SC_PAGESIZE);
+    bool mapped = reinterpret_cast<uintptr_t>(region) % page == 0 && IMAGE_ALIGN % page == 0 &&
+        mmap(region, cell_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, IMAGE_ALIGN) != MAP_FAILED;
+    if (!mapped) {
+        std::memcpy(region, file + IMAGE_ALIGN, header.cells * sizeof(Cell));
+    }
+    close(fd);
+
+    // Relocate, if the region has moved since the image was saved.
+    Ref delta = Ref(immortal_base - header.base);
+    if (delta != 0) {
+        for (size_t i = 0; i < header.cells; ++i) {
+            if (region[i].car & SYMBOL_TAG) continue;
+            region[i].car += delta;
+            region[i].cdr += delta;
+        }
+    }
+    immortal_top = immortal_base + header.cells;
+
+    // The image's symbols replace the table.
+    symbols.resize(0);
+    for (size_t i = 0; i < header.symbols; ++i) {
+        const ImageSymbol& rec = records[i];
+        std::string_view name(names + rec.name, rec.size);
+        symbols.push_back({name, std::hash<std::string_view>()(name), &region[rec.cell], rec.pinned != 0, false});
+    }
+    rehash_atoms();
+
+    nil = make_immortal_symbol("nil");
+    truth = make_immortal_symbol("t");
+    return &region[header.roots];
+}
+
+// -----------------------------------------------------------------------------
+// Unit Tests
+// -----------------------------------------------------------------------------
+
+TEST_CASE("Memory: Initialization and Symbols") {
+    init_memory();
+    CHECK(nil != nullptr);
+    CHECK(truth != nullptr);
+    CHECK(is_symbol(nil));
+    CHECK(is_symbol(truth));
+    CHECK(symbol_name(nil) == "nil");
+    CHECK(symbol_name(truth) == "t");
+}
+
+TEST_CASE("Memory: Interning") {
+    Cell* s1 = make_symbol("foo");
+    Cell* s2 = make_symbol("foo");
+    Cell* s3 = make_symbol("bar");
+
+    CHECK(s1 == s2);
+    CHECK(s1 != s3);
+    CHECK(symbol_name(s1) == "foo");
+}
+
+TEST_CASE("Memory: Compact cells") {
+    CHECK(sizeof(Cell) == 8);
+    CHECK(is_symbol(nil));
+    CHECK_FALSE(is_cons(nil));
+}
+
+TEST_CASE("Memory: Cons") {
+    Cell* s1 = make_symbol("a");
+    Cell* s2 = make_symbol("b");
+    Cell* c = cons(s1, s2);
+
+    CHECK(is_cons(c));
+    CHECK(car(c) == s1);
+    CHECK(cdr(c) == s2);
+}
+
+TEST_CASE("Memory: Garbage Collection") {
+    // We need to simulate filling the heap.
+    // Since heap is large (1M), we can't easily fill it in a quick test.
+    // But we can verify that things are marked/swept if we manually trigger GC.
+
+    gc_trace = false; // Silence output
+
+    Cell* s1 = make_symbol("keep");
+    Root r_s1(s1);
+    Cell* c1 = cons(s1, nil);
+
+    // c1 is a root.
+    Root r_c1(c1);
+    gc();
+
+    // c1 should still be valid.
+    CHECK(is_cons(c1));
+    CHECK(car(c1) == s1);
+
+    // Allocate something that we drop.
+    Cell* garbage = cons(make_symbol("trash"), nil);
+    (void)garbage; // Suppress unused warning
+
+    // Trigger GC without including 'garbage' in roots.
+    // 'garbage' should be reclaimed.
     // We can't easily check if it was reclaimed without inspecting the free list or using trace stats.
     // But we can check that c1 is still good.
-    gc({c1});
-    CHECK(c1->pair.car == s1);
+    gc();
+    CHECK(car(c1) == s1);
+}
+
+TEST_CASE("Memory: Sweep across bitmap words") {
+    gc_trace = false;
+
+    // Build a list long enough to span several 64-cell bitmap words.
+    Cell* sym = make_symbol("elem");
+    Cell* list = nil;
+    Root r_sym(sym), r_list(list);
+    for (int i = 0; i < 200; ++i) {
+        list = cons(sym, list);
+    }
+    cons(sym, nil); // garbage
+
+    gc();
+
+    int length = 0;
+    for (Cell* c = list; is_cons(c); c = cdr(c)) {
+        CHECK(car(c) == sym);
+        ++length;
+    }
+    CHECK(length == 200);
+
+    // Freed cells come off the free list in ascending address order.
+    Cell* a = cons(sym, nil);
+    Cell* b = cons(sym, nil);
+    CHECK(a < b);
+}
+
+TEST_CASE("Memory: Generational nursery") {
+    gc_trace = false;
+    set_gc_mode(GC_GENERATIONAL);
+
+    Cell* sym = make_symbol("young");
+    Cell* keep = nil;
+    Root r_sym(sym), r_keep(keep);
+
+    // Fill the nursery twice over, keeping only every 1000th cell reachable.
+    for (size_t i = 0; i < 2 * NURSERY_SIZE; ++i) {
+        Cell* c = cons(sym, (i % 1000 == 0) ? keep : nil);
+        if (i % 1000 == 0) keep = c;
+    }
+
+    // The older survivors were promoted out of the nursery, with their
+    // links rewritten to the promoted copies.
+    size_t length = 0;
+    size_t promoted = 0;
+    for (Cell* c = keep; is_cons(c); c = cdr(c)) {
+        CHECK(car(c) == sym);
+        if (ref_of(c) < heap_size) promoted++;
+        length++;
+    }
+    CHECK(length == (2 * NURSERY_SIZE + 999) / 1000);
+    CHECK(promoted > 0);
+
+    set_gc_mode(GC_MARK_SWEEP);
+}
+
+TEST_CASE("Memory: Copying collection") {
+    gc_trace = false;
+    set_gc_mode(GC_COPYING);
+
+    Cell* keep = nil;
+    Root r_keep(keep);
+    for (int i = 0; i < 100; ++i) {
+        keep = cons(make_symbol("x"), keep);
+    }
+
+    // Fill the semispace with garbage so that the list is copied at least once.
+    for (size_t i = 0; i < heap_size / 2; ++i) {
+        cons(nil, nil);
+    }
+
+    // The surviving list spine is contiguous.
+    int length = 0;
+    for (Cell* c = keep; is_cons(c); c = cdr(c)) {
+        CHECK(car(c) == make_symbol("x"));
+        if (is_cons(cdr(c))) CHECK(ref_of(cdr(c)) == ref_of(c) + 1);
+        length++;
+    }
+    CHECK(length == 100);
+
+    set_gc_mode(GC_MARK_SWEEP);
+    CHECK(symbol_name(car(keep)) == "x");
+}
+
+TEST_CASE("Memory: Mark-compact collection") {
+    gc_trace = false;
+    set_gc_mode(GC_COMPACT);
+
+    // Interleave the cells of a kept list with garbage.
+    Cell* keep = nil;
+    Root r_keep(keep);
+    for (int i = 0; i < 100; ++i) {
+        keep = cons(make_symbol("y"), keep);
+        cons(nil, nil);
+    }
+    size_t before = alloc_top;
+
+    gc();
+
+    // Everything live now sits at the bottom of the heap, with the list
+    // spine in consecutive cells.
+    CHECK(alloc_top < before);
+    CHECK(ref_of(keep) < alloc_top);
+    int length = 0;
+    for (Cell* c = keep; is_cons(c); c = cdr(c)) {
+        CHECK(car(c) == make_symbol("y"));
+        if (is_cons(cdr(c))) CHECK(ref_of(cdr(c)) == ref_of(c) + 1);
+        length++;
+    }
+    CHECK(length == 100);
+
+    set_gc_mode(GC_MARK_SWEEP);
+}
+
+TEST_CASE("Memory: Marking a very long list") {
+    gc_trace = false;
+
+    // Long enough that one C stack frame per element would overflow.
+    Cell* sym = make_symbol("long");
+    Cell* list = nil;
+    Root r_list(list);
+    for (int i = 0; i < 500000; ++i) {
+        list = cons(sym, list);
+    }
+
+    gc();
+
+    int length = 0;
+    for (Cell* c = list; is_cons(c); c = cdr(c)) {
+        length++;
+    }
+    CHECK(length == 500000);
+}
+
+TEST_CASE("Memory: Parallel mark and sweep") {
+    gc_trace = false;
+
+    // A long list and a tree of short ones, with garbage in between.
+    Cell* sym = make_symbol("p");
+    Cell* keep = nil;
+    Root r_keep(keep);
+    for (int i = 0; i < 20000; ++i) {
+        Cell* inner = cons(sym, cons(sym, nil));
+        keep = cons(inner, keep);
+        cons(sym, sym);
+    }
+
+    gc();
+    size_t serial_free = free_count;
+
+    gc_threads = 4;
+    gc();
+    gc_threads = 1;
+
+    CHECK(free_count == serial_free);
+
+    // The joined free runs cover every free cell, in ascending address
+    // order, with no two runs touching.
+    size_t listed = 0;
+    bool ascending = true;
+    for (size_t i = 0; i < free_runs.size(); ++i) {
+        CHECK(free_runs[i].begin < free_runs[i].end);
+        if (i > 0 && free_runs[i].begin <= free_runs[i - 1].end) ascending = false;
+        listed += free_runs[i].end - free_runs[i].begin;
+    }
+    if (!free_runs.empty()) CHECK(free_runs.back().end <= frontier);
+    CHECK(listed + (heap_size - frontier) == free_count);
+    CHECK(ascending);
+
+    int length = 0;
+    for (Cell* c = keep; is_cons(c); c = cdr(c)) {
+        CHECK(car(car(c)) == sym);
+        CHECK(car(cdr(car(c))) == sym);
+        length++;
+    }
+    CHECK(length == 20000);
+}
+
+TEST_CASE("Memory: Concurrent background marking") {
+    gc_trace = false;
+    set_gc_mode(GC_CONCURRENT);
+
+    Cell* sym = make_symbol("c");
+    Cell* keep = nil;
+    Root r_keep(keep);
+    for (int i = 0; i < 1000; ++i) {
+        keep = cons(sym, keep);
+    }
+
+    // Allocate garbage until a background cycle has started, run to
+    // completion, and been swept, while still consing onto the kept list.
+    bool started = false;
+    for (size_t i = 0; i < 2 * heap_size; ++i) {
+        if (i % 1000 == 0) {
+            keep = cons(sym, keep);
+            if (background.active) started = true;
+        }
+        cons(sym, nil);
+        if (background.active) started = true;
+        if (started && !background.active) break;
+    }
+    CHECK(started);
+    CHECK_FALSE(background.active);
+    CHECK_FALSE(concurrent_start_due());
+
+    int length = 0;
+    for (Cell* c = keep; is_cons(c); c = cdr(c)) {
+        CHECK(car(c) == sym);
+        length++;
+    }
+    CHECK(length > 1000);
+
+    set_gc_mode(GC_MARK_SWEEP);
+}
+
+TEST_CASE("Memory: Lazy sweeping") {
+    gc_trace = false;
+
+    Cell* sym = make_symbol("lazy");
+    Cell* keep = nil;
+    Root r_keep(keep);
+    for (int i = 0; i < 10000; ++i) {
+        keep = cons(sym, keep);
+        cons(sym, sym);
+    }
+
+    // Collection only marks; nothing has been swept yet.
+    gc();
+    CHECK(free_runs.empty());
+    CHECK(sweep_cursor == 0);
+    size_t available = free_count;
+
+    // Each allocation that finds the free list empty sweeps one more block,
+    // and takes a batch of cells from it for this thread's buffer.
+    Cell* c = cons(sym, nil);
+    CHECK(sweep_cursor > 0);
+    CHECK(sweep_cursor < sweep_end);
+    CHECK(available - free_count == tlab.end - tlab.top + 1);
+    CHECK(is_cons(c));
+
+    int length = 0;
+    for (Cell* l = keep; is_cons(l); l = cdr(l)) {
+        CHECK(car(l) == sym);
+        length++;
+    }
+    CHECK(length == 10000);
+}
+
+TEST_CASE("Memory: Bump allocation through free runs") {
+    gc_trace = false;
+
+    // Leave a gap of garbage between two kept cells.
+    Cell* sym = make_symbol("run");
+    Cell* keep = cons(sym, nil);
+    Root r_keep(keep);
+    for (int i = 0; i < 100; ++i) {
+        cons(sym, sym);
+    }
+    keep = cons(sym, keep);
+
+    gc();
+
+    // Skip any runs too short to test, then check that consecutive conses
+    // land in consecutive cells.
+    Cell* a = cons(sym, nil);
+    while (tlab.end - tlab.top < 2) {
+        a = cons(sym, nil);
+    }
+    Cell* b = cons(sym, nil);
+    Cell* c = cons(sym, nil);
+    CHECK(ref_of(b) == ref_of(a) + 1);
+    CHECK(ref_of(c) == ref_of(b) + 1);
+}
+
+TEST_CASE("Memory: Heap growth") {
+    gc_trace = false;
+
+    for (GcMode mode : {GC_MARK_SWEEP, GC_COPYING, GC_COMPACT}) {
+        set_gc_mode(mode);
+        size_t start_size = heap_size;
+
+        // Keep more cells alive than the heap held to begin with.
+        Cell* sym = make_symbol("grow");
+        Cell* keep = nil;
+        Root r_keep(keep);
+        size_t n = start_size + HEAP_CHUNK;
+        for (size_t i = 0; i < n; ++i) {
+            keep = cons(sym, keep);
+        }
+
+        CHECK(heap_size > start_size);
+        CHECK(heap_size % HEAP_CHUNK == 0);
+        CHECK(heap_size <= heap_max);
+
+        size_t length = 0;
+        for (Cell* c = keep; is_cons(c); c = cdr(c)) {
+            length++;
+        }
+        CHECK(length == n);
+    }
+
+    set_gc_mode(GC_MARK_SWEEP);
+}
+
+TEST_CASE("Memory: Allocation frontier") {
+    gc_trace = false;
+
+    // Relaying out the heap packs the live cells below the frontier.
+    Cell* sym = make_symbol("fresh");
+    Root r_sym(sym);
+    set_gc_mode(GC_MARK_SWEEP);
+    size_t start = frontier;
+    CHECK(start < heap_size);
+
+    // Once the short run below it is used up, cells come from the frontier.
+    Cell* c = cons(sym, nil);
+    while (frontier == start) {
+        c = cons(sym, nil);
+    }
+    CHECK(ref_of(c) == start);
+    CHECK(frontier == std::min(start + FRONTIER_STEP, heap_size));
+
+    // A collection sweeps nothing past the frontier.
+    gc();
+    CHECK(sweep_end == frontier / 64);
+    CHECK(free_count >= heap_size - frontier);
+}
+
+TEST_CASE("Memory: Heap shrinking") {
+    gc_trace = false;
+
+    for (GcMode mode : {GC_MARK_SWEEP, GC_COMPACT}) {
+        set_gc_mode(mode);
+
+        Cell* sym = make_symbol("shrink");
+        Root r_sym(sym);
+        Cell* keep = cons(sym, nil);
+        Root r_keep(keep);
+
+        // Grow the heap with a big live list, then drop it.
+        Cell* big = nil;
+        Root r_big(big);
+        for (size_t i = 0; i < 4 * heap_initial; ++i) {
+            big = cons(sym, big);
+        }
+        size_t grown = heap_size;
+        CHECK(grown > heap_initial);
+        big = nil;
+
+        gc();
+        CHECK(heap_size < grown);
+        CHECK(heap_size >= heap_initial);
+
+        // The heap still works, including the pages that were given back.
+        CHECK(car(keep) == sym);
+        for (size_t i = 0; i < grown; ++i) {
+            big = cons(sym, (i % 2) ? big : nil);
+        }
+        CHECK(car(big) == sym);
+    }
+
+    set_gc_mode(GC_MARK_SWEEP);
+}
+
+TEST_CASE("Memory: Hash-consing") {
+    gc_trace = false;
+    hash_cons = true;
+
+    Cell* a = make_symbol("a");
+    Cell* b = make_symbol("b");
+    Root r_a(a), r_b(b);
+
+    // Structurally equal lists are the same cells.
+    Cell* x = cons(a, cons(b, nil));
+    Root r_x(x);
+    Cell* y = cons(a, cons(b, nil));
+    CHECK(x == y);
+    Cell* ba = cons(b, a);
+    Root r_ba(ba);
+    CHECK(ba != cons(a, b));
+
+    // So are lists the reader builds as program text.
+    Cell* ia = make_immortal_symbol("hash-cons-a");
+    Cell* ib = make_immortal_symbol("hash-cons-b");
+    REQUIRE(is_immortal(ia));
+    Cell** text_items[] = {&ia, &ib};
+    Cell* text = make_immortal_list(text_items, 2, nil);
+    Root r_text(text);
+    CHECK(text == cons(ia, cons(ib, nil)));
+
+    // The table is weak: unreachable entries go at the next collection.
+    for (int i = 0; i < 1000; ++i) {
+        cons(a, cons(b, cons(a, nil)));
+        cons(make_symbol("n" + std::to_string(i)), nil);
+    }
+    size_t before = cons_table_count;
+    gc();
+    CHECK(cons_table_count < before);
+    CHECK(cons(a, cons(b, nil)) == x);
+
+    // Sharing survives collectors that move cells.
+    for (GcMode mode : {GC_COPYING, GC_GENERATIONAL, GC_MARK_SWEEP}) {
+        set_gc_mode(mode);
+        CHECK(cons(a, cons(b, nil)) == x);
+        Cell* junk = nil;
+        Root r_junk(junk);
+        for (size_t i = 0; i < 2 * NURSERY_SIZE; ++i) {
+            junk = cons(a, junk);
+        }
+        Cell* shared = cons(a, junk);
+        Root r_shared(shared);
+        CHECK(shared == cons(a, junk));
+        CHECK(cons(a, cons(b, nil)) == x);
+    }
+
+    hash_cons = false;
+}
+
+TEST_CASE("Memory: Deduplicating collection") {
+    gc_trace = false;
+    gc_dedup = true;
+
+    for (GcMode mode : {GC_COPYING, GC_COMPACT}) {
+        set_gc_mode(mode);
+
+        // Two equal lists with a shared tail, built separately.
+        Cell* a = make_symbol("a");
+        Cell* b = make_symbol("b");
+        Root r_a(a), r_b(b);
+        Cell* x = cons(a, cons(b, cons(a, nil)));
+        Root r_x(x);
+        Cell* y_car = cons(a, nil);
+        Root r_y_car(y_car);
+        Cell* y = cons(b, cons(a, nil));
+        Root r_y(y);
+        y = cons(y_car, y);
+        Cell* z = cons(a, cons(b, cons(a, nil)));
+        Root r_z(z);
+        CHECK(x != z);
+
+        gc();
+        CHECK(x == z);
+        CHECK(cdr(y) == cdr(x));
+        CHECK(car(y) == cdr(cdr(x)));
+        CHECK(car(x) == a);
+        CHECK(car(cdr(x)) == b);
+        CHECK(cdr(cdr(cdr(x))) == nil);
+    }
+
+    gc_dedup = false;
+    set_gc_mode(GC_MARK_SWEEP);
+}
+
+TEST_CASE("Memory: Lists laid out in consecutive cells") {
+    gc_trace = false;
+
+    for (GcMode mode : {GC_MARK_SWEEP, GC_GENERATIONAL, GC_COPYING, GC_COMPACT}) {
+        set_gc_mode(mode);
+
+        Cell* a = make_symbol("a");
+        Cell* b = make_symbol("b");
+        Cell* c = make_symbol("c");
+        Root r_a(a), r_b(b), r_c(c);
+
+        Cell** items[] = {&a, &b, &c};
+        Cell* list = make_list(items, 3, nil);
+        CHECK(car(list) == a);
+        CHECK(car(cdr(list)) == b);
+        CHECK(car(cdr(cdr(list))) == c);
+        CHECK(cdr(cdr(cdr(list))) == nil);
+        CHECK(ref_of(cdr(list)) == ref_of(list) + 1);
+        CHECK(ref_of(cdr(cdr(list))) == ref_of(list) + 2);
+
+        CHECK(make_list(nullptr, 0, a) == a);
+        CHECK(cdr(make_list(&items[1], 1, a)) == a);
+    }
+
+    set_gc_mode(GC_MARK_SWEEP);
+}
+
+TEST_CASE("Memory: Atom table") {
+    // Enough symbols to rehash the table several times over.
+    std::vector<std::string> names;
+    for (int i = 0; i < 5000; ++i) {
+        names.push_back("atom-" + std::to_string(i));
+    }
+    Cell* keep = nil;
+    Root r_keep(keep);
+    std::vector<Ref> refs;
+    for (const std::string& name : names) {
+        Cell* sym = make_symbol(name);
+        refs.push_back(ref_of(sym));
+        keep = cons(sym, keep);
+    }
+
+    // Every name still finds its own symbol, and the names are intact.
+    for (size_t i = 0; i < names.size(); ++i) {
+        Cell* sym = make_symbol(std::string_view(names[i]));
+        CHECK(ref_of(sym) == refs[i]);
+        CHECK(symbol_name(sym) == names[i]);
+    }
+
+    // A lookup through a view into a longer string matches on the view only.
+    std::string text = "atom-12 atom-123";
+    CHECK(ref_of(make_symbol(std::string_view(text).substr(0, 7))) == refs[12]);
+    CHECK(ref_of(make_symbol(std::string_view(text).substr(8))) == refs[123]);
+}
+
+TEST_CASE("Memory: Symbol collection") {
+    gc_trace = false;
+
+    for (GcMode mode : {GC_MARK_SWEEP, GC_COPYING}) {
+        set_gc_mode(mode);
+
+        Cell* kept = make_symbol("kept-symbol");
+        Root r_kept(kept);
+        for (int i = 0; i < 1000; ++i) {
+            make_symbol("one-off-" + std::to_string(i));
+        }
+        size_t before = symbols.size();
+
+        gc();
+        CHECK(symbols.size() <= before - 1000);
+
+        // Survivors keep their names and identity, and are still found.
+        CHECK(symbol_name(kept) == "kept-symbol");
+        CHECK(make_symbol("kept-symbol") == kept);
+        CHECK(symbol_name(nil) == "nil");
+        CHECK(make_symbol("nil") == nil);
+        CHECK(make_symbol("t") == truth);
+        for (std::string_view name : {"quote", "cond", "lambda", "label"}) {
+            CHECK(symbol_name(make_symbol(name)) == name);
+        }
+
+        // A collected name can be interned again as a new symbol.
+        Cell* again = make_symbol("one-off-7");
+        CHECK(symbol_name(again) == "one-off-7");
+        CHECK(make_symbol("one-off-7") == again);
+    }
+
+    set_gc_mode(GC_MARK_SWEEP);
+}
+
+TEST_CASE("Memory: Concurrent interning") {
+    set_gc_mode(GC_MARK_SWEEP);
+
+    // Threads race to intern the same new names, growing the table as they
+    // go, once with symbols on the heap and once in the immortal region.
+    // Nothing may collect meanwhile, or while the symbols are gathered into
+    // a list afterwards, so there must be room for every thread to make its
+    // own copy of every symbol, and for the list.
+    for (bool immortal : {false, true}) {
+        gc();
+        const int threads = 4;
+        std::string prefix = immortal ? "immortal-shared-" : "shared-";
+        std::vector<std::string> names;
+        for (int i = 0; i < 3000; ++i) {
+            names.push_back(prefix + std::to_string(i));
+        }
+        REQUIRE(free_count > (threads + 1) * names.size() + TLAB_CELLS);
+
+        std::vector<std::vector<Cell*>> seen(threads);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                for (size_t i = 0; i < names.size(); ++i) {
+                    // Each thread walks the names from a different starting point.
+                    size_t k = (i + t * names.size() / threads) % names.size();
+                    Cell* sym = immortal ? make_immortal_symbol(names[k]) : make_symbol(names[k]);
+                    seen[t].push_back(sym);
+                }
+            });
+        }
+        for (std::thread& w : workers) w.join();
+
+        // Every thread got the same symbol for each name.
+        Cell* keep = nil;
+        Root r_keep(keep);
+        for (Cell* sym : seen[0]) {
+            keep = cons(sym, keep);
+        }
+        for (int t = 0; t < threads; ++t) {
+            for (size_t i = 0; i < names.size(); ++i) {
+                size_t k = (i + t * names.size() / threads) % names.size();
+                CHECK(seen[t][i] == seen[0][k]);
+                CHECK(symbol_name(seen[t][i]) == names[k]);
+            }
+        }
+
+        // The losing copies are dropped by the next collection, immortal
+        // ones too, and the winners are still the ones found.
+        gc();
+        size_t shared = 0;
+        for (size_t i = 0; i < symbols.size(); ++i) {
+            if (symbols[i].name.substr(0, prefix.size()) == prefix) ++shared;
+        }
+        CHECK(shared == names.size());
+        for (size_t k = 0; k < names.size(); ++k) {
+            CHECK(make_symbol(names[k]) == seen[0][k]);
+        }
+    }
+}
+
+TEST_CASE("Memory: Shadow-stack roots") {
+    gc_trace = false;
+    set_gc_mode(GC_COPYING);
+    Root* top = root_top;
+
+    // Nested roots are updated when their cells move, and unregister in
+    // reverse order as they go out of scope.
+    Cell* outer = cons(make_symbol("outer"), nil);
+    {
+        Root r_outer(outer);
+        Cell* inner = cons(make_symbol("inner"), outer);
+        Root r_inner(inner);
+        CHECK(root_top == &r_inner);
+        CHECK(r_inner.prev == &r_outer);
+
+        Ref before = ref_of(inner);
+        gc();
+        CHECK(ref_of(inner) != before);
+        CHECK(cdr(inner) == outer);
+        CHECK(symbol_name(car(inner)) == "inner");
+        CHECK(symbol_name(car(outer)) == "outer");
+    }
+    CHECK(root_top == top);
+
+    // An exception unwinds the roots registered below the handler.
+    try {
+        Cell* c = cons(nil, nil);
+        Root r_c(c);
+        throw std::runtime_error("unwind");
+    } catch (const std::runtime_error&) {
+    }
+    CHECK(root_top == top);
+
+    set_gc_mode(GC_MARK_SWEEP);
+}
+
+TEST_CASE("Memory: Immortal region") {
+    gc_trace = false;
+
+    // Text built in the region survives collections of every kind without
+    // being rooted, and nothing moves it. Collect first, so that symbols
+    // earlier tests left unreachable are not counted.
+    gc();
+    size_t mark = immortal_mark();
+    size_t symbol_count = symbols.size();
+    Cell* a = make_immortal_symbol("immortal-a");
+    Cell* b = make_immortal_symbol("immortal-b");
+    Cell** inner_items[] = {&b, &a};
+    Cell* inner = make_immortal_list(inner_items, 2, nil);
+    Cell** items[] = {&a, &inner};
+    Cell* text = make_immortal_list(items, 2, b);
+    REQUIRE(is_immortal(text));
+    REQUIRE(is_immortal(a));
+    Ref before = ref_of(text);
+
+    for (GcMode mode : {GC_MARK_SWEEP, GC_GENERATIONAL, GC_COPYING, GC_COMPACT, GC_CONCURRENT}) {
+        set_gc_mode(mode);
+        for (int i = 0; i < 1000; ++i) {
+            cons(make_symbol("immortal-garbage-" + std::to_string(i)), nil);
+        }
+        gc();
+        CHECK(ref_of(text) == before);
+        CHECK(car(text) == a);
+        CHECK(car(car(cdr(text))) == b);
+        CHECK(car(cdr(car(cdr(text)))) == a);
+        CHECK(cdr(cdr(text)) == b);
+        CHECK(symbol_name(a) == "immortal-a");
+        CHECK(make_symbol("immortal-b") == b);
+    }
+    set_gc_mode(GC_MARK_SWEEP);
+
+    // Releasing gives back the cells and drops the symbols made since the
+    // mark, and the next text reuses them.
+    release_immortal(mark);
+    CHECK(immortal_mark() == mark);
+    CHECK(symbols.size() == symbol_count);
+    std::string_view gone = "immortal-a";
+    CHECK(find_atom(atom_table.load(), gone, std::hash<std::string_view>()(gone)) == -1);
+    CHECK(symbol_name(nil) == "nil");
+    CHECK(make_symbol("lambda") == make_immortal_symbol("lambda"));
+
+    Cell* again = make_immortal_symbol("immortal-a");
+    CHECK(ref_of(again) == mark);
+    CHECK(symbol_name(again) == "immortal-a");
+    CHECK(make_symbol("immortal-a") == again);
+    release_immortal(mark);
+
+    // The names go back to the arena too, and the atom table does not fill
+    // up with the slots they took.
+    size_t table_size = atom_table.load()->size;
+    size_t arena_size = name_arena_size;
+    size_t arena_used = name_block_used;
+    for (int i = 0; i < 10000; ++i) {
+        make_immortal_symbol("immortal-name-" + std::to_string(i));
+        release_immortal(mark);
+    }
+    CHECK(name_arena_size == arena_size);
+    CHECK(name_block_used == arena_used);
+    CHECK(atom_table.load()->size == table_size);
+
+    // Once the region is full, symbols and lists fall back to the heap.
+    // Releasing then renumbers the heap symbols made after the mark, and
+    // keeps them.
+    Cell* first = make_immortal_symbol("immortal-first");
+    REQUIRE(is_immortal(first));
+    size_t room = immortal_base + IMMORTAL_SIZE - immortal_top;
+    Cell* filler = alloc_immortal(room);
+    for (size_t i = 0; i < room; ++i) {
+        filler[i].car = filler[i].cdr = ref_of(nil);
+    }
+    Cell* late = make_immortal_symbol("immortal-late");
+    Root r_late(late);
+    CHECK_FALSE(is_immortal(late));
+    Cell** late_items[] = {&first, &late};
+    Cell* list = make_immortal_list(late_items, 2, nil);
+    Root r_list(list);
+    CHECK_FALSE(is_immortal(list));
+    CHECK(car(list) == first);
+
+    release_immortal(mark);
+    CHECK(immortal_mark() == mark);
+    CHECK(symbol_name(late) == "immortal-late");
+    CHECK(make_symbol("immortal-late") == late);
+    std::string_view dropped = "immortal-first";
+    CHECK(find_atom(atom_table.load(), dropped, std::hash<std::string_view>()(dropped)) == -1);
+    CHECK(is_immortal(make_immortal_symbol("immortal-next")));
+    release_immortal(mark);
+
+    // Releasing text leaves a background mark running.
+    set_gc_mode(GC_CONCURRENT);
+    make_immortal_symbol("immortal-during-mark");
+    start_background_mark();
+    release_immortal(mark);
+    CHECK(background.active);
+    gc();
+    CHECK_FALSE(background.active);
+    set_gc_mode(GC_MARK_SWEEP);
+}
+
+TEST_CASE("Memory: Arena reclamation") {
+    gc_trace = false;
+
+    for (GcMode mode : {GC_MARK_SWEEP, GC_GENERATIONAL, GC_COPYING}) {
+        set_gc_mode(mode);
+        Cell* kept = cons(make_symbol("kept"), nil);
+        Root r_kept(kept);
+
+        // Everything allocated since arena_begin() is handed back, so the
+        // next form allocates the same cells again.
+        arena_begin();
+        Cell* first = cons(nil, nil);
+        for (int i = 0; i < 100; ++i) cons(nil, nil);
+        CHECK(arena_end());
+
+        arena_begin();
+        CHECK(cons(nil, nil) == first);
+        CHECK(arena_end());
+        CHECK(symbol_name(car(kept)) == "kept");
+
+        // A collection in between leaves the cells to the collector.
+        arena_begin();
+        cons(nil, nil);
+        gc();
+        CHECK_FALSE(arena_end());
+
+        // So does a symbol made on the heap, which the atom table refers to.
+        arena_begin();
+        make_symbol("arena-symbol");
+        CHECK_FALSE(arena_end());
+    }
+
+    set_gc_mode(GC_MARK_SWEEP);
+}
+
+TEST_CASE("Memory: Thread-local allocation buffers") {
+    gc_trace = false;
+    set_gc_mode(GC_MARK_SWEEP);
+    gc();
+
+    // Consecutive conses on one thread come from its buffer, and a refill
+    // takes a whole batch at once.
+    Cell* sym = make_symbol("tlab");
+    Root r_sym(sym);
+    Cell* a = cons(sym, nil);
+    while (tlab.end - tlab.top < 2) {
+        a = cons(sym, nil);
+    }
+    CHECK(ref_of(cons(sym, nil)) == ref_of(a) + 1);
+    CHECK(tlab.end - tlab.top <= TLAB_CELLS);
+
+    // A collection leaves the buffer stale, so it is refilled.
+    gc();
+    CHECK_FALSE(tlab_current());
+    cons(sym, nil);
+    CHECK(tlab_current());
+
+    // Threads cons their own lists at once. Nothing may collect meanwhile.
+    const int threads = 4;
+    const int length = 20000;
+    REQUIRE(free_count > threads * (length + TLAB_CELLS));
+
+    std::vector<Cell*> lists(threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            Cell* list = nil;
+            for (int i = 0; i < length; ++i) {
+                list = cons(sym, list);
+            }
+            lists[t] = list;
+        });
+    }
+    for (std::thread& w : workers) w.join();
+
+    // No cell was handed to two threads.
+    std::vector<Ref> cells;
+    for (Cell* list : lists) {
+        int n = 0;
+        for (Cell* c = list; is_cons(c); c = cdr(c)) {
+            CHECK(car(c) == sym);
+            cells.push_back(ref_of(c));
+            n++;
+        }
+        CHECK(n == length);
+    }
+    std::sort(cells.begin(), cells.end());
+    CHECK(std::adjacent_find(cells.begin(), cells.end()) == cells.end());
+}
+
+TEST_CASE("Memory: Heap images") {
+    gc_trace = false;
+    set_gc_mode(GC_MARK_SWEEP);
+
+    // (image-a (image-b) . image-a), all in the immortal region.
+    Cell* a = make_immortal_symbol("image-a");
+    Cell* b = make_immortal_symbol("image-b");
+    Cell** inner_items[] = {&b};
+    Cell* inner = make_immortal_list(inner_items, 1, nil);
+    Cell** root_items[] = {&a, &inner};
+    Cell* roots = make_immortal_list(root_items, 2, a);
+    REQUIRE(is_immortal(roots));
+
+    std::string path = "/tmp/autolisp-test-" + std::to_string(getpid()) + ".img";
+    save_image(path, roots);
+
+    // This heap has been used, so loading over it is refused and changes nothing.
+    std::string not_fresh = "Images must be loaded before anything is allocated: " + path;
+    CHECK_THROWS_WITH(load_image(path), not_fresh.c_str());
+    CHECK(symbol_name(car(roots)) == "image-a");
+    CHECK(make_immortal_symbol("image-b") == b);
+
+    // On a fresh heap, even one heap symbol is too many.
+    reset_memory();
+    make_symbol("image-dropped");
+    CHECK_THROWS_WITH(load_image(path), not_fresh.c_str());
+
+    reset_memory();
+    Cell* loaded = load_image(path);
+
+    CHECK(is_immortal(loaded));
+    CHECK(symbol_name(car(loaded)) == "image-a");
+    CHECK(symbol_name(car(car(cdr(loaded)))) == "image-b");
+    CHECK(cdr(car(cdr(loaded))) == nil);
+    CHECK(cdr(cdr(loaded)) == car(loaded));
+    CHECK(make_symbol("image-a") == car(loaded));
+    CHECK(symbol_name(nil) == "nil");
+    CHECK(symbol_name(truth) == "t");
+
+    // The collector still works on top of the loaded region.
+    {
+        Cell* keep = cons(car(loaded), nil);
+        Root r_keep(keep);
+        gc();
+        CHECK(car(keep) == make_symbol("image-a"));
+    }
+
+    reset_memory();
+    CHECK_THROWS_WITH(load_image("/nonexistent/autolisp.img"), "Could not open image: /nonexistent/autolisp.img");
+
+    // A cons pointing outside the image is rejected before anything is loaded.
+    {
+        std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+        Ref outside = ~Ref(0) >> 2;
+        f.seekp(IMAGE_ALIGN + (ref_of(roots) - immortal_base) * sizeof(Cell));
+        f.write(reinterpret_cast<const char*>(&outside), sizeof(outside));
+    }
+    CHECK_THROWS_WITH(load_image(path), ("Corrupt image: " + path).c_str());
+    std::remove(path.c_str());
+    CHECK(!is_immortal(make_symbol("image-a")));
+}
+
+TEST_CASE("Memory: GC statistics") {
+    gc_trace = false;
+    set_gc_mode(GC_MARK_SWEEP);
+    gc_stats_file = "/tmp/autolisp-test-" + std::to_string(getpid()) + ".json";
+    gc_records.clear();
+
+    Cell* sym = make_symbol("stats");
+    Root r_sym(sym);
+    gc();
+    for (int i = 0; i < 1000; ++i) {
+        cons(sym, nil);
+    }
+    gc();
+
+    // The second collection saw the conses allocated since the first.
+    REQUIRE(gc_records.size() == 2);
+    CHECK(std::string(gc_records[1].kind) == "full");
+    CHECK(gc_records[1].allocated >= 1000);
+    CHECK(gc_records[1].reclaimed >= 1000);
+    CHECK(gc_records[1].pause_ms >= gc_records[1].mark_ms);
+
+    write_gc_stats();
+    std::ifstream in(gc_stats_file);
+    std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    CHECK(json.find("\"collections\": 2") != std::string::npos);
+    CHECK(json.find("\"pause_ms\": {\"total\"") != std::string::npos);
+    CHECK(json.find("\"p99\"") != std::string::npos);
+    std::remove(gc_stats_file.c_str());
+
+    // Minor collections that sweep lazily while promoting charge the time to
+    // the full collection whose sweep is pending, not to themselves.
+    set_gc_mode(GC_GENERATIONAL);
+    gc_records.clear();
+    Cell* keep = nil;
+    Root r_keep(keep);
+    for (size_t i = 0; i < 3 * NURSERY_SIZE; ++i) {
+        keep = cons(sym, keep);
+    }
+    keep = nil;
+    gc();
+    for (size_t i = 0; i < 3 * NURSERY_SIZE; ++i) {
+        keep = cons(sym, keep);
+    }
+    size_t minors = 0;
+    for (const GcRecord& rec : gc_records) {
+        if (std::string(rec.kind) == "minor") {
+            CHECK(rec.sweep_ms == 0);
+            minors++;
+        }
+    }
+    CHECK(minors > 0);
+    set_gc_mode(GC_MARK_SWEEP);
+
+    gc_stats_file.clear();
+    gc_records.clear();
 }
@@ -1,22 +1,24 @@
 #pragma once
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 
+// A Ref is a 32-bit index into the heap. Cells refer to each other by Ref
+// rather than by pointer, so a cell is 8 bytes instead of 32.
+typedef uint32_t Ref;
+
+// The top bit of a cell's car marks it as a symbol; the remaining bits of
+// that car are the symbol's index in the name table.
+const Ref SYMBOL_TAG = Ref(1) << 31;
+
 struct Cell {
-    enum Type { SYMBOL, CONS };
-    Type type;
-
-    union {
-        const std::string* symbol_name;
-        struct {
-            Cell* car;
-            Cell* cdr;
-        } pair;
-    };
-
-    bool mark = false;
+    Ref car;
+    Ref cdr;
 };
 
+extern Cell* heap;
+
 // Global constants
 extern Cell* nil;
 extern Cell* truth;
@@ -24,18 +26,129 @@ extern Cell* truth;
 // Initialization
 void init_memory();
 
-// Allocation
+// Allocation. cons() takes cells from a buffer private to the calling thread.
+// Several threads may cons at once, but only outside GC_CONCURRENT, without
+// hash_cons, and while none of them needs a collection: starting a background
+// mark, the hash-cons table, the collectors and the Root stack they fall back
+// on are not synchronized.
 Cell* cons(Cell* car, Cell* cdr);
-Cell* make_symbol(const std::string& name);
+
+// Build the list of *items[0], ..., *items[n - 1], ending in tail. Each item is
+// read through a slot that must be rooted, since allocating may move it.
+// Where there is room, the spine is laid out in consecutive cells in list
+// order, so walking the list scans forward through memory. This is only a
+// layout: the cells are ordinary conses with an explicit cdr, not CDR-coded,
+// so the list takes as much memory as one built by cons(). Without room for
+// a block it conses under a Root, so only one thread may call it.
+Cell* make_list(Cell** const* items, size_t n, Cell* tail);
+Cell* make_symbol(std::string_view name);
+
+// Program text. The reader builds what it reads in an immortal region that
+// collections count as live and never mark, sweep or move. An immortal list
+// may only hold immortal cells, so these fall back to the ordinary heap when
+// an item is not immortal or the region is full.
+Cell* make_immortal_list(Cell** const* items, size_t n, Cell* tail);
+Cell* make_immortal_symbol(std::string_view name);
+bool is_immortal(Cell* c);
+
+// Text is only collected on request: release_immortal(mark) gives back every
+// immortal cell allocated since immortal_mark() returned 'mark', and drops the
+// symbols among them. Nothing may still refer to those cells. It takes time
+// in proportion to what it releases, and leaves a background mark running.
+// Like a collection, it must not run while other threads intern.
+size_t immortal_mark();
+void release_immortal(size_t mark);
+
+// Conversion between Refs and Cell pointers
+inline Cell* cell_at(Ref r) { return &heap[r]; }
+inline Ref ref_of(Cell* c) { return Ref(c - heap); }
 
 // Predicates
-bool is_symbol(Cell* c);
-bool is_cons(Cell* c);
+inline bool is_symbol(Cell* c) { return c && (c->car & SYMBOL_TAG); }
+inline bool is_cons(Cell* c) { return c && !(c->car & SYMBOL_TAG); }
+
+// Accessors
+inline Cell* car(Cell* c) { return cell_at(c->car); }
+inline Cell* cdr(Cell* c) { return cell_at(c->cdr); }
+
+// The name stays valid only until the next collection, which may move it.
+std::string_view symbol_name(Cell* c);
 
 // Garbage Collection
+enum GcMode {
+    GC_MARK_SWEEP,   // Single heap, mark and sweep
+    GC_GENERATIONAL, // Bump-allocated nursery, promoted into the mark-sweep heap
+    GC_COPYING,      // Two semispaces, Cheney copying
+    GC_COMPACT,      // Mark, then compact live cells to the bottom of the heap
+    GC_CONCURRENT    // Mark-sweep with marking on a background thread
+};
+
+extern GcMode gc_mode;
+extern int gc_threads;
 extern bool gc_trace;
+
+// When set, every collection's pause, mark and sweep times and cell counts
+// are kept, and write_gc_stats() writes them to this file as JSON, with
+// percentiles over all collections and the allocation rate.
+extern std::string gc_stats_file;
+void write_gc_stats();
+
+// When set, cons() returns an existing cell with the same car and cdr, if
+// there is one, instead of allocating a new one.
+extern bool hash_cons;
+
+// When set, collections that copy cells also merge structurally identical
+// conses into one copy. Only the copying and compact collectors copy cells.
+extern bool gc_dedup;
 extern bool heap_initialized;
 
-// gc takes root pointers. For now, we'll expose a function to register roots or just pass them.
-// A simple way is to pass the environment and maybe a list of temporary roots.
-void gc(std::vector<Cell*> roots);
+// Heap sizing, in cells. The heap starts at heap_initial and grows after
+// collections that leave it crowded, up to heap_max. Set before init_memory().
+extern size_t heap_initial;
+extern size_t heap_max;
+
+// Root registration.
+// A Root keeps the Cell* variable it wraps visible to the collector for as long
+// as the Root is in scope. Collections that move cells update the variable.
+// The Roots themselves form a shadow stack, each linked to the one registered
+// before it, so registering a root never allocates. There is one stack, so
+// only one thread may register Roots.
+struct Root;
+extern Root* root_top;
+
+struct Root {
+    explicit Root(Cell*& slot) : slot(&slot), prev(root_top) { root_top = this; }
+    ~Root() { root_top = prev; }
+
+    Root(const Root&) = delete;
+    Root& operator=(const Root&) = delete;
+
+    Cell** slot;
+    Root* prev;
+};
+
+// Arena reclamation. arena_end() hands back every cell allocated since the
+// last arena_begin(), in O(1), so it is only safe when nothing allocated in
+// between is still referenced, as between independent top-level forms. If a
+// collection ran in between, or hash-consing or a new heap symbol may refer
+// to the cells, it releases nothing, leaves them to the collector and
+// returns false. Only the calling thread may allocate in between.
+void arena_begin();
+bool arena_end();
+
+// Heap images. save_image() writes the immortal region and its symbols to a
+// file, with 'roots', which must be immortal, as the entry point.
+// load_image() maps such a file back in place of the region and the whole
+// symbol table, and returns its roots. It must be called before anything is
+// allocated or interned after init_memory(), and refuses otherwise. Both
+// throw std::runtime_error on failure.
+void save_image(const std::string& path, Cell* roots);
+Cell* load_image(const std::string& path);
+
+// Switch collectors at runtime. Live cells are moved, so callers must hold
+// them in Roots.
+void set_gc_mode(GcMode mode);
+
+// Collect garbage. Everything the caller still needs must be reachable from a
+// Root, a global constant or a pinned symbol.
+void gc();
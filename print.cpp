@@ -6,8 +6,8 @@ std::string print(Cell* c) {
     if (c == truth) return "t"; // Although t is just a symbol, we might want to ensure it prints as t. But if it's a symbol, the symbol logic handles it.
 
     if (is_symbol(c)) {
-        // c->symbol_name is a pointer to std::string
-        return *c->symbol_name;
+        // symbol_name() looks up the interned name
+        return std::string(symbol_name(c));
     }
 
     if (is_cons(c)) {
@@ -21,8 +21,8 @@ std::string print(Cell* c) {
                 break;
             }
 
-            s += print(curr->pair.car);
-            curr = curr->pair.cdr;
+            s += print(car(curr));
+            curr = cdr(curr);
 
             if (curr != nil) {
                 s += " ";
@@ -35,9 +35,9 @@ std::vector<std::string> tokenize(const std::string& input) {
 }
 
 // Forward decl
-Cell* read_list_body_fwd(std::vector<std::string>& tokens);
+Cell* read_list_body_fwd(std::vector<std::string>& tokens, bool immortal);
 
-Cell* read_from_tokens(std::vector<std::string>& tokens) {
+Cell* read_from_tokens(std::vector<std::string>& tokens, bool immortal) {
      if (tokens.empty()) {
         throw std::runtime_error("Unexpected EOF");
     }
@@ -46,37 +46,48 @@ Cell* read_from_tokens(std::vector<std::string>& tokens) {
     tokens.erase(tokens.begin());
 
     if (token == "(") {
-        return read_list_body_fwd(tokens);
+        return read_list_body_fwd(tokens, immortal);
     } else if (token == ")") {
         throw std::runtime_error("Unexpected ')'");
     } else if (token == ".") {
         throw std::runtime_error("Unexpected '.'");
     } else {
-        return make_symbol(token);
+        return immortal ? make_immortal_symbol(token) : make_symbol(token);
     }
 }
 
-Cell* read_list_body_fwd(std::vector<std::string>& tokens) {
+// Read the rest of a list after its '('. Each element read so far is held in
+// a rooted local further up the recursion, and 'items' points at each one,
+// so the whole spine can be allocated in one piece at the closing ')'.
+Cell* read_list_items(std::vector<std::string>& tokens, std::vector<Cell**>& items, bool immortal) {
+    auto make = immortal ? make_immortal_list : make_list;
     if (tokens.empty()) throw std::runtime_error("Unexpected EOF");
 
     if (tokens[0] == ")") {
         tokens.erase(tokens.begin());
-        return nil;
+        return make(items.data(), items.size(), nil);
     }
 
-    Cell* car = read_from_tokens(tokens);
+    Cell* car = read_from_tokens(tokens, immortal);
+    Root r_car(car);
+    items.push_back(&car);
 
     if (!tokens.empty() && tokens[0] == ".") {
         tokens.erase(tokens.begin());
-        Cell* cdr = read_from_tokens(tokens);
+        Cell* cdr = read_from_tokens(tokens, immortal);
         if (tokens.empty() || tokens[0] != ")") {
             throw std::runtime_error("Expected ')' after dotted pair");
         }
         tokens.erase(tokens.begin());
-        return cons(car, cdr);
+        return make(items.data(), items.size(), cdr);
     }
 
-    return cons(car, read_list_body_fwd(tokens));
+    return read_list_items(tokens, items, immortal);
+}
+
+Cell* read_list_body_fwd(std::vector<std::string>& tokens, bool immortal) {
+    std::vector<Cell**> items;
+    return read_list_items(tokens, items, immortal);
 }
 
 Cell* read(const std::string& input) {
@@ -93,12 +104,62 @@ TEST_CASE("Reader") {
     init_memory();
 
     SUBCASE("Atoms") {
-        CHECK(read("foo")->symbol_name != nullptr);
-        CHECK(*read("foo")->symbol_name == "foo");
+        CHECK(is_symbol(read("foo")));
+        CHECK(symbol_name(read("foo")) == "foo");
     }
 
     SUBCASE("Lists") {
         Cell* l = read("(a b)");
         CHECK(print(l) == "(a b)");
     }
+
+    SUBCASE("Dotted lists") {
+        CHECK(print(read("(a b . c)")) == "(a b . c)");
+        CHECK(print(read("((a) . (b))")) == "((a) b)");
+    }
+
+    SUBCASE("List spines are consecutive") {
+        Cell* l = read("(a (b c) d)");
+        CHECK(ref_of(cdr(l)) == ref_of(l) + 1);
+        CHECK(ref_of(cdr(cdr(l))) == ref_of(l) + 2);
+    }
+
+    SUBCASE("Program text is immortal") {
+        auto tokens = tokenize("(lambda (zz) (cond (zz (quote yy))))");
+        Cell* l = read_from_tokens(tokens, true);
+        CHECK(is_immortal(l));
+        CHECK(is_immortal(car(cdr(l))));
+        CHECK(is_immortal(car(car(cdr(l)))));
+
+        // Unrooted, it survives collections of every kind, and nothing moves it.
+        Ref before = ref_of(l);
+        for (GcMode mode : {GC_COPYING, GC_COMPACT, GC_MARK_SWEEP}) {
+            set_gc_mode(mode);
+            gc();
+        }
+        CHECK(ref_of(l) == before);
+        CHECK(print(l) == "(lambda (zz) (cond (zz (quote yy))))");
+
+        // A list holding a symbol that lives on the ordinary heap goes there too.
+        Cell* sym = make_symbol("heap-symbol");
+        Root r_sym(sym);
+        tokens = tokenize("(heap-symbol)");
+        Cell* m = read_from_tokens(tokens, true);
+        CHECK(!is_immortal(m));
+        CHECK(car(m) == sym);
+
+        // Released text gives its symbols back.
+        size_t mark = immortal_mark();
+        tokens = tokenize("(released-symbol)");
+        CHECK(is_immortal(read_from_tokens(tokens, true)));
+        release_immortal(mark);
+        CHECK(immortal_mark() == mark);
+        CHECK(!is_immortal(make_symbol("released-symbol")));
+    }
+
+    SUBCASE("Other input is collected") {
+        Cell* l = read("(one-off-atom (b))");
+        CHECK(!is_immortal(l));
+        CHECK(!is_immortal(car(l)));
+    }
 }
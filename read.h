@@ -10,5 +10,7 @@ Cell* read(const std::string& input);
 std::vector<std::string> tokenize(const std::string& input);
 
 // Reads a single S-expression from the token stream.
-// Modifies the tokens vector by consuming tokens.
-Cell* read_from_tokens(std::vector<std::string>& tokens);
+// Modifies the tokens vector by consuming tokens. With 'immortal' set, the
+// expression is built in the immortal region, as program text that is kept
+// until it is released.
+Cell* read_from_tokens(std::vector<std::string>& tokens, bool immortal = false);